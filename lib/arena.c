@@ -0,0 +1,59 @@
+#include "arena.h"
+#include <stdalign.h>
+#include <stdlib.h>
+
+typedef struct arena_block {
+  struct arena_block *next;
+  max_align_t data[];
+} arena_block;
+
+struct arena {
+  char *next, *end; // free part of the current block
+  arena_block *extra; // blocks past the first, most recent first
+  size_t size;
+  max_align_t first[];
+};
+
+arena *arena_create(size_t size) {
+  arena *a = malloc(sizeof(arena) + size);
+  if (a == NULL)
+    return NULL;
+  a->size = size;
+  a->extra = NULL;
+  arena_reset(a);
+  return a;
+}
+
+void arena_destroy(arena *a) {
+  if (a == NULL)
+    return;
+  arena_reset(a);
+  free(a);
+}
+
+void *arena_alloc(arena *a, size_t size) {
+  size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+  if ((size_t)(a->end - a->next) < size) {
+    size_t block_size = size > a->size ? size : a->size;
+    arena_block *block = malloc(sizeof(arena_block) + block_size);
+    if (block == NULL)
+      return NULL;
+    block->next = a->extra;
+    a->extra = block;
+    a->next = (char *)block->data;
+    a->end = a->next + block_size;
+  }
+  void *p = a->next;
+  a->next += size;
+  return p;
+}
+
+void arena_reset(arena *a) {
+  while (a->extra != NULL) {
+    arena_block *block = a->extra;
+    a->extra = block->next;
+    free(block);
+  }
+  a->next = (char *)a->first;
+  a->end = a->next + a->size;
+}
@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Bump-pointer allocator for objects that all die at once. Allocating is a
+ * pointer increment within a block set aside up front; should that run out
+ * further blocks are malloc'd, and arena_reset frees those and rewinds to the
+ * start of the first, so an arena that fits its objects costs no malloc or
+ * free at all. Not thread-safe. */
+
+typedef struct arena arena;
+
+// size is what the first block holds, and the least any later one does
+arena *arena_create(size_t size);
+
+void arena_destroy(arena *a);
+
+// Uninitialized memory aligned for any type, NULL when out of memory. It
+// stays valid until the next arena_reset.
+void *arena_alloc(arena *a, size_t size);
+
+// Gives back everything allocated so far
+void arena_reset(arena *a);
+
+#endif
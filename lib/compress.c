@@ -0,0 +1,349 @@
+#include "compress.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#ifdef HTTP_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#define COMPRESS_CACHE_BUCKETS 1024 // must be a power of two
+#define COMPRESS_STREAM_CHUNK 16384 // output handed to a stream's sink
+
+const char *const compress_coding_str[] = {
+    [COMPRESS_NONE] = "identity",
+    [COMPRESS_GZIP] = "gzip",
+    [COMPRESS_DEFLATE] = "deflate",
+};
+
+#ifdef HTTP_WITH_ZLIB
+// q-value Accept-Encoding gives coding, directly or through "*"; -1 when
+// it lists neither
+static double compress_quality(const char *accept, const char *coding) {
+  double any = -1;
+  size_t coding_len = strlen(coding);
+  const char *p = accept;
+  while (*p != '\0') {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      p++;
+    if (*p == '\0')
+      break;
+    size_t len = strcspn(p, " \t;,");
+    const char *end = p + len + strcspn(p + len, ",");
+    double q = 1;
+    for (const char *param = memchr(p, ';', end - p); param != NULL;
+         param = memchr(param + 1, ';', end - (param + 1))) {
+      const char *s = param + 1;
+      while (*s == ' ' || *s == '\t')
+        s++;
+      if ((*s == 'q' || *s == 'Q') && s[1] == '=')
+        q = strtod(s + 2, NULL);
+    }
+    if (len == coding_len && strncasecmp(p, coding, len) == 0)
+      return q;
+    if (len == 1 && *p == '*')
+      any = q;
+    p = end;
+  }
+  return any;
+}
+#endif
+
+enum compress_coding compress_negotiate(const char *accept_encoding) {
+#ifdef HTTP_WITH_ZLIB
+  if (accept_encoding == NULL)
+    return COMPRESS_NONE;
+  double gzip = compress_quality(accept_encoding, "gzip");
+  double deflate = compress_quality(accept_encoding, "deflate");
+  if (gzip > 0 && gzip >= deflate)
+    return COMPRESS_GZIP;
+  if (deflate > 0)
+    return COMPRESS_DEFLATE;
+#else
+  (void)accept_encoding;
+#endif
+  return COMPRESS_NONE;
+}
+
+#ifdef HTTP_WITH_ZLIB
+// gzip wraps the deflate stream in a gzip header and trailer, HTTP's
+// deflate in a zlib one
+static int compress_init(z_stream *zs, enum compress_coding coding,
+                         int level) {
+  memset(zs, 0, sizeof *zs);
+  int window_bits = coding == COMPRESS_GZIP ? 15 + 16 : 15;
+  return deflateInit2(zs, level, Z_DEFLATED, window_bits, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK
+             ? 0
+             : -1;
+}
+#endif
+
+char *compress_body(enum compress_coding coding, int level, const char *data,
+                    size_t len, size_t *out_len) {
+#ifdef HTTP_WITH_ZLIB
+  z_stream zs;
+  if (len == 0 || len > UINT_MAX || compress_init(&zs, coding, level) != 0)
+    return NULL;
+  // No larger than the body, or it is not worth sending encoded
+  char *out = malloc(len);
+  if (out != NULL) {
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = len;
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+      *out_len = zs.total_out;
+    } else {
+      free(out);
+      out = NULL;
+    }
+  }
+  deflateEnd(&zs);
+  return out;
+#else
+  (void)coding, (void)level, (void)data, (void)len, (void)out_len;
+  return NULL;
+#endif
+}
+
+unsigned long compress_checksum(const char *data, size_t len) {
+#ifdef HTTP_WITH_ZLIB
+  unsigned long crc = crc32(0L, Z_NULL, 0);
+  while (len > 0) {
+    uInt n = len > UINT_MAX ? UINT_MAX : (uInt)len;
+    crc = crc32(crc, (const Bytef *)data, n);
+    data += n;
+    len -= n;
+  }
+  return crc;
+#else
+  unsigned long hash = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+  return hash;
+#endif
+}
+
+struct compress_stream {
+#ifdef HTTP_WITH_ZLIB
+  z_stream zs;
+#endif
+  enum compress_coding coding;
+};
+
+compress_stream *compress_stream_new(enum compress_coding coding, int level) {
+#ifdef HTTP_WITH_ZLIB
+  compress_stream *stream = malloc(sizeof(compress_stream));
+  if (stream == NULL)
+    return NULL;
+  if (compress_init(&stream->zs, coding, level) != 0) {
+    free(stream);
+    return NULL;
+  }
+  stream->coding = coding;
+  return stream;
+#else
+  (void)coding, (void)level;
+  return NULL;
+#endif
+}
+
+int compress_stream_write(compress_stream *stream, const char *data,
+                          size_t len, bool finish,
+                          int (*sink)(void *arg, const char *out, size_t n),
+                          void *arg) {
+#ifdef HTTP_WITH_ZLIB
+  char out[COMPRESS_STREAM_CHUNK];
+  z_stream *zs = &stream->zs;
+  do {
+    uInt n = len > UINT_MAX ? UINT_MAX : (uInt)len;
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = n;
+    data += n;
+    len -= n;
+    int flush = len > 0 ? Z_NO_FLUSH : finish ? Z_FINISH : Z_SYNC_FLUSH;
+    // Output is handed on whenever the buffer fills, and at the end
+    do {
+      zs->next_out = (Bytef *)out;
+      zs->avail_out = sizeof out;
+      if (deflate(zs, flush) == Z_STREAM_ERROR)
+        return -1;
+      size_t produced = sizeof out - zs->avail_out;
+      int rc = produced > 0 ? sink(arg, out, produced) : 0;
+      if (rc != 0)
+        return rc;
+    } while (zs->avail_out == 0);
+  } while (len > 0);
+  return 0;
+#else
+  (void)stream, (void)data, (void)len, (void)finish, (void)sink, (void)arg;
+  return -1;
+#endif
+}
+
+void compress_stream_free(compress_stream *stream) {
+  if (stream == NULL)
+    return;
+#ifdef HTTP_WITH_ZLIB
+  deflateEnd(&stream->zs);
+#endif
+  free(stream);
+}
+
+typedef struct compress_node {
+  compress_entry entry; // first, so an entry pointer is its node
+  char *key;
+  enum compress_coding coding;
+  size_t len; // of the body before encoding
+  unsigned long checksum;
+  unsigned hash;
+  atomic_int refs; // the cache's own while it holds the node, plus callers'
+  struct compress_node *chain;       // next in the hash bucket
+  struct compress_node *prev, *next; // recency list, most recent first
+} compress_node;
+
+struct compress_cache {
+  pthread_mutex_t lock;
+  compress_node *buckets[COMPRESS_CACHE_BUCKETS];
+  compress_node *newest, *oldest;
+  size_t bytes, max_bytes;
+};
+
+// FNV-1a over the key, then the coding
+static unsigned compress_hash(const char *key, enum compress_coding coding) {
+  unsigned h = 2166136261u;
+  for (; *key != '\0'; key++)
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  return (h ^ coding) * 16777619u;
+}
+
+compress_cache *compress_cache_create(size_t max_bytes) {
+  compress_cache *cache = calloc(1, sizeof(compress_cache));
+  if (cache == NULL)
+    return NULL;
+  cache->max_bytes = max_bytes;
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+void compress_cache_release(compress_entry *entry) {
+  compress_node *node = (compress_node *)entry;
+  if (atomic_fetch_sub(&node->refs, 1) != 1)
+    return;
+  free(node->key);
+  free((char *)node->entry.data);
+  free(node);
+}
+
+void compress_cache_destroy(compress_cache *cache) {
+  if (cache == NULL)
+    return;
+  compress_node *node = cache->newest;
+  while (node != NULL) {
+    compress_node *next = node->next;
+    compress_cache_release(&node->entry);
+    node = next;
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+static void compress_unlink_recent(compress_cache *cache, compress_node *node) {
+  if (node->prev != NULL)
+    node->prev->next = node->next;
+  else
+    cache->newest = node->next;
+  if (node->next != NULL)
+    node->next->prev = node->prev;
+  else
+    cache->oldest = node->prev;
+  node->prev = node->next = NULL;
+}
+
+static void compress_push_recent(compress_cache *cache, compress_node *node) {
+  node->next = cache->newest;
+  if (cache->newest != NULL)
+    cache->newest->prev = node;
+  cache->newest = node;
+  if (cache->oldest == NULL)
+    cache->oldest = node;
+}
+
+static compress_node *compress_find(compress_cache *cache, const char *key,
+                                    enum compress_coding coding,
+                                    unsigned hash) {
+  compress_node *node = cache->buckets[hash & (COMPRESS_CACHE_BUCKETS - 1)];
+  while (node != NULL && (node->hash != hash || node->coding != coding ||
+                          strcmp(node->key, key) != 0))
+    node = node->chain;
+  return node;
+}
+
+static void compress_remove(compress_cache *cache, compress_node *node) {
+  compress_node **slot =
+      &cache->buckets[node->hash & (COMPRESS_CACHE_BUCKETS - 1)];
+  while (*slot != node)
+    slot = &(*slot)->chain;
+  *slot = node->chain;
+  compress_unlink_recent(cache, node);
+  cache->bytes -= node->entry.len;
+  compress_cache_release(&node->entry);
+}
+
+compress_entry *compress_cache_get(compress_cache *cache, const char *key,
+                                   enum compress_coding coding, size_t len,
+                                   unsigned long checksum) {
+  unsigned hash = compress_hash(key, coding);
+  pthread_mutex_lock(&cache->lock);
+  compress_node *node = compress_find(cache, key, coding, hash);
+  if (node != NULL && node->len == len && node->checksum == checksum) {
+    compress_unlink_recent(cache, node);
+    compress_push_recent(cache, node);
+    atomic_fetch_add(&node->refs, 1);
+  } else {
+    node = NULL;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return node != NULL ? &node->entry : NULL;
+}
+
+compress_entry *compress_cache_put(compress_cache *cache, const char *key,
+                                   enum compress_coding coding, size_t len,
+                                   unsigned long checksum, char *data,
+                                   size_t data_len) {
+  if (data_len > cache->max_bytes)
+    return NULL;
+  compress_node *node = malloc(sizeof(compress_node));
+  char *key_copy = strdup(key);
+  if (node == NULL || key_copy == NULL) {
+    free(node);
+    free(key_copy);
+    return NULL;
+  }
+  *node = (compress_node){.entry = {.data = data, .len = data_len},
+                          .key = key_copy,
+                          .coding = coding,
+                          .len = len,
+                          .checksum = checksum,
+                          .hash = compress_hash(key, coding)};
+  atomic_init(&node->refs, 2); // the cache's and the caller's
+
+  pthread_mutex_lock(&cache->lock);
+  compress_node *old = compress_find(cache, key, coding, node->hash);
+  if (old != NULL)
+    compress_remove(cache, old);
+  compress_node **slot =
+      &cache->buckets[node->hash & (COMPRESS_CACHE_BUCKETS - 1)];
+  node->chain = *slot;
+  *slot = node;
+  compress_push_recent(cache, node);
+  cache->bytes += data_len;
+  // Never the new entry, which fits by itself
+  while (cache->bytes > cache->max_bytes)
+    compress_remove(cache, cache->oldest);
+  pthread_mutex_unlock(&cache->lock);
+  return &node->entry;
+}
@@ -0,0 +1,77 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Content codings for responses, on top of zlib. A build without
+ * HTTP_WITH_ZLIB keeps the interface but never negotiates a coding, so
+ * nothing else here is reached. */
+
+enum compress_coding { COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_DEFLATE };
+
+extern const char *const compress_coding_str[];
+
+// Coding to send a response in for a request's Accept-Encoding (which may
+// be NULL): gzip when it is acceptable, else deflate, else none
+enum compress_coding compress_negotiate(const char *accept_encoding);
+
+// len bytes of data encoded at level (1-9), malloc'd, with its length in
+// *out_len. NULL when that fails or saves nothing.
+char *compress_body(enum compress_coding coding, int level, const char *data,
+                    size_t len, size_t *out_len);
+
+// Checksum telling bodies cached under the same key apart
+unsigned long compress_checksum(const char *data, size_t len);
+
+typedef struct compress_stream compress_stream;
+
+compress_stream *compress_stream_new(enum compress_coding coding, int level);
+
+// Encodes the next len bytes and passes the output to sink, a buffer at a
+// time. Everything written so far is flushed out, so the client can decode
+// it right away; with finish set the stream is ended instead. Stops at and
+// returns the first non-zero sink result, -1 if zlib fails.
+int compress_stream_write(compress_stream *stream, const char *data,
+                          size_t len, bool finish,
+                          int (*sink)(void *arg, const char *out, size_t n),
+                          void *arg);
+
+void compress_stream_free(compress_stream *stream);
+
+/* Encoded bodies kept by key so a response sent again is not encoded again.
+ * An entry only matches a body of the same length and checksum, so a key
+ * whose response changed misses instead of serving the old one. Least
+ * recently used entries go once max_bytes is exceeded. Entries are
+ * reference counted: one taken with compress_cache_get or _put stays valid
+ * until it is released, even if the cache has since evicted it, so it can
+ * be sent without a copy. Safe to share between threads. */
+typedef struct compress_cache compress_cache;
+
+typedef struct compress_entry {
+  const char *data; // the encoded body
+  size_t len;
+} compress_entry;
+
+compress_cache *compress_cache_create(size_t max_bytes);
+
+void compress_cache_destroy(compress_cache *cache);
+
+// Encoded body stored for key, NULL on a miss. The caller owns one
+// reference and must hand it back with compress_cache_release.
+compress_entry *compress_cache_get(compress_cache *cache, const char *key,
+                                   enum compress_coding coding, size_t len,
+                                   unsigned long checksum);
+
+// Takes over data, malloc'd, replacing what key had for coding, and returns
+// the new entry with a reference for the caller. NULL when it is not
+// stored, which leaves data to the caller.
+compress_entry *compress_cache_put(compress_cache *cache, const char *key,
+                                   enum compress_coding coding, size_t len,
+                                   unsigned long checksum, char *data,
+                                   size_t data_len);
+
+// Needs no cache, so it may run after compress_cache_destroy
+void compress_cache_release(compress_entry *entry);
+
+#endif
@@ -0,0 +1,264 @@
+#include "filecache.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct filecache_node {
+  filecache_entry entry; // first, so an entry pointer is its node
+  char *path;
+  unsigned hash;
+  atomic_int refs; // the cache's own while it holds the node, plus callers'
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  long long checked; // last time the path was stat'ed
+  bool confined;      // found under the root given to filecache_get
+  struct filecache_node *chain;       // next in the hash bucket
+  struct filecache_node *prev, *next; // recency list, most recent first
+} filecache_node;
+
+struct filecache {
+  pthread_mutex_t lock;
+  filecache_node **buckets;
+  unsigned mask;
+  filecache_node *newest, *oldest;
+  int count, capacity, ttl_ms;
+};
+
+static const struct {
+  const char *ext;
+  const char *type;
+} filecache_types[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"mjs", "text/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"txt", "text/plain"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/x-icon"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"wasm", "application/wasm"},
+};
+
+static const char *filecache_content_type(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (dot != NULL && strchr(dot, '/') == NULL)
+    for (size_t i = 0; i < sizeof filecache_types / sizeof *filecache_types;
+         i++)
+      if (strcasecmp(dot + 1, filecache_types[i].ext) == 0)
+        return filecache_types[i].type;
+  return "application/octet-stream";
+}
+
+static long long filecache_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a
+static unsigned filecache_hash(const char *path) {
+  unsigned h = 2166136261u;
+  for (; *path != '\0'; path++)
+    h = (h ^ (unsigned char)*path) * 16777619u;
+  return h;
+}
+
+// Whether st still describes the file node has open
+static bool filecache_fresh(filecache_node *node, const struct stat *st) {
+  return S_ISREG(st->st_mode) && st->st_dev == node->dev &&
+         st->st_ino == node->ino && st->st_size == node->entry.size &&
+         st->st_mtim.tv_sec == node->mtime.tv_sec &&
+         st->st_mtim.tv_nsec == node->mtime.tv_nsec;
+}
+
+filecache *filecache_create(int capacity, int ttl_ms) {
+  filecache *cache = calloc(1, sizeof(filecache));
+  if (cache == NULL)
+    return NULL;
+  // Buckets outnumber entries, so chains stay short
+  unsigned buckets = 16;
+  while (buckets < (unsigned)capacity * 2)
+    buckets *= 2;
+  cache->buckets = calloc(buckets, sizeof(filecache_node *));
+  if (cache->buckets == NULL) {
+    free(cache);
+    return NULL;
+  }
+  cache->mask = buckets - 1;
+  cache->capacity = capacity > 0 ? capacity : 1;
+  cache->ttl_ms = ttl_ms;
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+void filecache_release(filecache_entry *entry) {
+  filecache_node *node = (filecache_node *)entry;
+  if (atomic_fetch_sub(&node->refs, 1) != 1)
+    return;
+  close(node->entry.fd);
+  free(node->path);
+  free(node);
+}
+
+static void filecache_unlink_recent(filecache *cache, filecache_node *node) {
+  if (node->prev != NULL)
+    node->prev->next = node->next;
+  else
+    cache->newest = node->next;
+  if (node->next != NULL)
+    node->next->prev = node->prev;
+  else
+    cache->oldest = node->prev;
+  node->prev = node->next = NULL;
+}
+
+static void filecache_push_recent(filecache *cache, filecache_node *node) {
+  node->next = cache->newest;
+  if (cache->newest != NULL)
+    cache->newest->prev = node;
+  cache->newest = node;
+  if (cache->oldest == NULL)
+    cache->oldest = node;
+}
+
+// Drops node from the cache and gives up the cache's reference to it
+static void filecache_remove(filecache *cache, filecache_node *node) {
+  filecache_node **slot = &cache->buckets[node->hash & cache->mask];
+  while (*slot != node)
+    slot = &(*slot)->chain;
+  *slot = node->chain;
+  filecache_unlink_recent(cache, node);
+  cache->count--;
+  filecache_release(&node->entry);
+}
+
+static filecache_node *filecache_find(filecache *cache, const char *path,
+                                      unsigned hash) {
+  filecache_node *node = cache->buckets[hash & cache->mask];
+  while (node != NULL && (node->hash != hash || strcmp(node->path, path) != 0))
+    node = node->chain;
+  return node;
+}
+
+// Resolves path into resolved, false unless it ends up under root
+static bool filecache_beneath(const char *root, const char *path,
+                              char *resolved) {
+  char real_root[PATH_MAX];
+  if (realpath(root, real_root) == NULL || realpath(path, resolved) == NULL)
+    return false;
+  size_t len = strlen(real_root);
+  if (len == 1)
+    return true; // everything is under "/"
+  return strncmp(resolved, real_root, len) == 0 &&
+         (resolved[len] == '/' || resolved[len] == '\0');
+}
+
+// Opens path for the cache, NULL unless it is a regular file (under root,
+// when there is one). Non-blocking, so a FIFO (or a device) there is turned
+// away instead of hanging the open.
+static filecache_node *filecache_open(const char *path, const char *root,
+                                      unsigned hash) {
+  // The resolved path is what gets opened, with no symlink left to swap in
+  char resolved[PATH_MAX];
+  if (root != NULL && !filecache_beneath(root, path, resolved))
+    return NULL;
+  int fd = root != NULL
+               ? open(resolved, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOFOLLOW)
+               : open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  filecache_node *node = calloc(1, sizeof(filecache_node));
+  if (node == NULL || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      (node->path = strdup(path)) == NULL) {
+    free(node);
+    close(fd);
+    return NULL;
+  }
+  node->entry.fd = fd;
+  node->entry.size = st.st_size;
+  node->entry.content_type = filecache_content_type(path);
+  node->hash = hash;
+  node->dev = st.st_dev;
+  node->ino = st.st_ino;
+  node->mtime = st.st_mtim;
+  node->confined = root != NULL;
+  atomic_init(&node->refs, 2); // the cache's and the caller's
+  return node;
+}
+
+filecache_entry *filecache_get(filecache *cache, const char *path,
+                               const char *root) {
+  unsigned hash = filecache_hash(path);
+  long long now = filecache_now_ms();
+
+  pthread_mutex_lock(&cache->lock);
+  filecache_node *node = filecache_find(cache, path, hash);
+  // One opened without a root was never checked against it, and is
+  // replaced by one that was. A path swapped for a symlink shows up as a
+  // different file at the next check.
+  if (node != NULL && root != NULL && !node->confined)
+    node = NULL;
+  if (node != NULL && now - node->checked >= cache->ttl_ms) {
+    // Deploys replace files in place or rename new ones over them
+    struct stat st;
+    if (stat(path, &st) == -1 || !filecache_fresh(node, &st)) {
+      filecache_remove(cache, node);
+      node = NULL;
+    } else {
+      node->checked = now;
+    }
+  }
+  if (node != NULL) {
+    filecache_unlink_recent(cache, node);
+    filecache_push_recent(cache, node);
+    atomic_fetch_add(&node->refs, 1);
+    pthread_mutex_unlock(&cache->lock);
+    return &node->entry;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  // Opened without the lock held; a racing open of the same path wins last
+  node = filecache_open(path, root, hash);
+  if (node == NULL)
+    return NULL;
+  node->checked = now;
+
+  pthread_mutex_lock(&cache->lock);
+  filecache_node *old = filecache_find(cache, path, hash);
+  if (old != NULL)
+    filecache_remove(cache, old);
+  node->chain = cache->buckets[hash & cache->mask];
+  cache->buckets[hash & cache->mask] = node;
+  filecache_push_recent(cache, node);
+  if (++cache->count > cache->capacity)
+    filecache_remove(cache, cache->oldest);
+  pthread_mutex_unlock(&cache->lock);
+  return &node->entry;
+}
+
+void filecache_destroy(filecache *cache) {
+  while (cache->oldest != NULL)
+    filecache_remove(cache, cache->oldest);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->buckets);
+  free(cache);
+}
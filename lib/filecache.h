@@ -0,0 +1,36 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <sys/types.h>
+
+/* Cache of open file descriptors and their stat results, keyed by path.
+ * Entries are reference counted: one taken with filecache_get stays open
+ * until it is released, even if the cache has since evicted or replaced it.
+ * A hit re-stats the path at most once per ttl, so a hot file costs no
+ * open or stat calls. Safe to share between threads. */
+
+typedef struct filecache filecache;
+
+typedef struct filecache_entry {
+  int fd;
+  off_t size;
+  const char *content_type; // guessed from the file name
+} filecache_entry;
+
+// capacity bounds the number of files kept open
+filecache *filecache_create(int capacity, int ttl_ms);
+
+// Closes every file not still referenced; those close on their last release
+void filecache_destroy(filecache *cache);
+
+// Opened regular file at path, NULL if there is none. With a root, path
+// must also resolve, symlinks followed, to somewhere under that directory;
+// a cache is expected to see one root at most. The caller owns one
+// reference and must hand it back with filecache_release.
+filecache_entry *filecache_get(filecache *cache, const char *path,
+                               const char *root);
+
+// Needs no cache, so it may run after filecache_destroy
+void filecache_release(filecache_entry *entry);
+
+#endif
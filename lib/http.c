@@ -1,13 +1,76 @@
+#define _GNU_SOURCE // accept4
 #include "http.h"
+#include "arena.h"
+#include "compress.h"
+#include "filecache.h"
+#include "scheduler.h"
+#include "timerwheel.h"
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#endif
+#ifdef HTTP_WITH_URING
+#include <liburing.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+// Line scanners for SSE4.2 and AVX2, picked at run time
+#define HTTP_SIMD_X86
+#endif
+
+#define HTTP_READ_BUF_SIZE 2048
+#define HTTP_ARENA_SIZE 2048 // a request with a few dozen headers
+#define HTTP_LISTEN_BACKLOG SOMAXCONN
+#define HTTP_EPOLL_BATCH 64
+#define HTTP_HANDLER_QUEUE 1024
+#define HTTP_KEEPALIVE_MAX_REQUESTS 100
+#define HTTP_KEEPALIVE_TIMEOUT_MS 5000
+#define HTTP_HEADER_TIMEOUT_MS 10000
+#define HTTP_BODY_TIMEOUT_MS 10000
+#define HTTP_TIMER_TICK_MS 100 // resolution of connection deadlines
+#define HTTP_SWEEP_INTERVAL_MS 1000 // lingering connections are checked
+#define HTTP_HANDOFF_MAX 253 // SCM_MAX_FD, sockets passed in one message
+#define HTTP_HANDOFF_TIMEOUT_MS 5000 // for the new process to confirm
+#define HTTP_IOV_BATCH 64
+#define HTTP_COPY_BODY_MAX 4096 // larger response bodies are sent in place
+#define HTTP_HEADERS_SIZE 256 // first buffer for a response's own headers
+#define HTTP_SEND_TIMEOUT_MS 30000 // handler threads waiting on a full socket
+#define HTTP_FILE_CACHE_SIZE 256
+#define HTTP_FILE_CACHE_TTL_MS 1000 // how stale a cached stat may get
+#define HTTP_COMPRESS_LEVEL 6 // zlib's own default
+#define HTTP_COMPRESS_CACHE_SIZE (8 * 1024 * 1024)
+#define HTTP_MAX_HEADER_SIZE (64 * 1024)
+#define HTTP_MAX_BODY_SIZE (1024 * 1024)
+#define HTTP_MAX_CHUNK_LINE 1024 // chunk size lines and trailer fields
+// How long a closed connection may wait for its zero-copy sends to complete
+// before they are aborted
+#define HTTP_ZEROCOPY_LINGER_MS 30000
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0 // no connection gets SO_ZEROCOPY without it
+#endif
 
 const char *const http_method_str[] = {
     [GET] = "GET",         [HEAD] = "HEAD",    [POST] = "POST",
@@ -20,43 +83,194 @@ const char *const http_version_str[] = {
     [HTTP_2_0] = "HTTP/2.0", [HTTP_3_0] = "HTTP/3.0",
 };
 
-// https://beej.us/guide/bgnet/pdf/bgnet_usl_c_1.pdf
+const char *const http_header_str[] = {
+    [HTTP_HEADER_HOST] = "Host",
+    [HTTP_HEADER_CONTENT_LENGTH] = "Content-Length",
+    [HTTP_HEADER_CONTENT_TYPE] = "Content-Type",
+    [HTTP_HEADER_CONNECTION] = "Connection",
+    [HTTP_HEADER_ACCEPT] = "Accept",
+    [HTTP_HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+    [HTTP_HEADER_IF_NONE_MATCH] = "If-None-Match",
+    [HTTP_HEADER_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [HTTP_HEADER_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [HTTP_HEADER_EXPECT] = "Expect",
+    [HTTP_HEADER_USER_AGENT] = "User-Agent",
+    [HTTP_HEADER_COOKIE] = "Cookie",
+    [HTTP_HEADER_AUTHORIZATION] = "Authorization",
+    [HTTP_HEADER_RANGE] = "Range",
+};
 
-// strips whitespace and shifts the body of the string to the
-// front of memory allocated to it
-void strip_whitespace(char *str) {
-  if (str == NULL || *str == '\0') {
-    return;
-  }
-  char *start = str;
-  while (isspace((unsigned char)*start)) {
-    start++;
-  }
-  if (*start == '\0') {
-    *str = '\0';
-    return;
-  }
-  char *end = start + strlen(start) - 1;
-  while (end > start && isspace((unsigned char)*end)) {
-    end--;
-  }
-  *(end + 1) = '\0';
-  if (str != start) {
-    memmove(str, start, end - start + 2);
-  }
-}
+// States past HTTP_PARSE_HEADERS have the whole header block
+enum http_parse_state {
+  HTTP_PARSE_REQUEST_LINE,
+  HTTP_PARSE_HEADERS,
+  HTTP_PARSE_BODY, // Content-Length bytes
+  HTTP_PARSE_CHUNK_SIZE,
+  HTTP_PARSE_CHUNK_DATA,
+  HTTP_PARSE_CHUNK_END, // CRLF closing a chunk's data
+  HTTP_PARSE_TRAILERS,
+  HTTP_PARSE_DONE,
+  HTTP_PARSE_ERROR,
+};
+
+typedef struct http_header_span {
+  int key_off, key_len;
+  int val_off, val_len;
+  enum http_header_id id;
+} http_header_span;
+
+typedef struct http_parser_limits {
+  int max_header_size;
+  long max_body_size;
+} http_parser_limits;
+
+// Deadline a connection is held to, see http_connection_arm
+enum http_timeout {
+  HTTP_TIMEOUT_NONE,
+  HTTP_TIMEOUT_IDLE,   // keep-alive between requests
+  HTTP_TIMEOUT_HEADER, // for the whole request line and headers
+  HTTP_TIMEOUT_BODY,   // between pieces of the body
+  HTTP_TIMEOUT_SEND,   // between writes of queued responses
+};
+
+// Progress through one request, see http_parser_execute
+typedef struct http_parser {
+  enum http_parse_state state;
+  int pos;  // next byte to look at
+  int line; // start of the line being read
+  int colon; // first ':' of that line seen so far, 0 for none
+  int method, version;
+  int uri_off, uri_len;
+  http_header_span *headers; // kept across requests for reuse
+  int header_count, header_cap;
+  long content_length;
+  bool has_length, chunked, expect_continue;
+  long chunk_left;
+  int body_off;  // decoded body is gathered at body_off...
+  int body_len;  // ...for body_len bytes
+  long body_read; // decoded body bytes so far, including ones handed off
+  int end;
+  int status; // response to refuse the request with after HTTP_PARSE_ERROR
+} http_parser;
+
+// Encoded response waiting in a connection's output queue: len bytes of data,
+// or of file from offset on when file is set. A zerocopy entry is sent on
+// its own with MSG_ZEROCOPY; once written it moves to the connection's
+// zero-copy list until the kernel reports the send with id zc_id done.
+typedef struct http_out {
+  char *data;
+  size_t len;
+  filecache_entry *file;
+  compress_entry *encoded; // holds data when set, which is not freed
+  off_t offset;
+  bool zerocopy;
+  bool zc_used; // some of it went out with MSG_ZEROCOPY
+  uint32_t zc_id; // of the last such send
+  struct http_out *next;
+} http_out;
+
+/* Per-connection state. Sockets are non-blocking, so a readable event is
+ * drained into buf until EAGAIN (required for edge-triggered epoll, which
+ * will not report the same readiness twice). buf grows while the request
+ * being parsed needs it, up to the server's header and body limits, and
+ * shrinks back once drained. It may hold several pipelined requests; start
+ * is where the next unserved one begins and parser tracks how far into it
+ * parsing got, so a request split across reads is never rescanned. Requests
+ * are served strictly in order and their responses collect in the out queue,
+ * which is flushed with a single sendmsg once nothing more can run.
+ *
+ * Flushing never waits: when the socket is full the connection is writing
+ * and the loop drains the rest of its queue as the socket becomes writable.
+ * No further requests are served until then, so a slow reader only ever
+ * holds its own buffered responses.
+ *
+ * While a handler thread owns a request the connection is busy and its loop
+ * leaves it alone until the handler's completion comes back. A request that
+ * must be the last one (no keep-alive, parse error, no response) marks the
+ * connection closing; it is closed once its queue is flushed.
+ *
+ * Zero-copy sends are numbered by the kernel in the order they were made and
+ * their completions arrive on the socket's error queue, which raises
+ * POLLERR. Buffers still in the kernel's hands wait on zc_head in the same
+ * order. A connection closed before they all complete lingers on its
+ * worker, shut down but not yet closed, until they do.
+ *
+ * Whatever a connection waits for has a deadline on its worker's timer
+ * wheel, moved along as it makes progress, so no loop ever scans every
+ * connection for the ones that expired. */
+typedef struct http_connection {
+  int fd;
+  int len, start;
+  int req_end;    // end of the request being served
+  char req_saved; // byte at req_end, overwritten by its NUL terminator
+  char *buf;
+  int cap; // bytes buf can hold, plus one for a terminator
+  http_parser parser;
+  bool busy;
+  bool keep_alive; // decided per request before the entrypoint runs
+  bool responded;  // http_respond ran for the current request
+  bool closing;
+  bool writing; // out queue waits for the socket to become writable
+  int served; // requests answered on this connection so far
+  // Request whose body is being handed to body_handler, built as soon as
+  // its headers are in
+  http_request *stream;
+  struct arena *arena; // backs the request being served
+  long long last_active;
+  timerwheel_timer timer;
+  enum http_timeout timeout; // what timer is set for
+  int poll_index;
+  http_out *out_head, *out_tail;
+  size_t out_sent; // bytes of out_head already written
+  bool zerocopy;   // SO_ZEROCOPY is on and worth using
+  bool lingering;
+  uint32_t zc_next, zc_done; // ids of the next send and first incomplete one
+  http_out *zc_head, *zc_tail;
+#ifdef HTTP_WITH_URING
+  bool sending, linked_close, recv_armed;
+  struct msghdr msg;
+  struct iovec iov[HTTP_IOV_BATCH];
+#endif
+  struct http_worker *worker;
+  struct http_connection *prev, *next; // worker's list of open connections
+  struct http_connection *next_done;
+} http_connection;
+
+// A parsed request waiting for a handler thread
+typedef struct http_job {
+  http_request *request;
+  http_connection *conn;
+  struct http_pool *pool;
+} http_job;
+
+/* Handler threads are a work-stealing scheduler. Requests are submitted as
+ * tasks and handlers may spawn sub-tasks of their own (see
+ * http_handler_scheduler). The number of requests in flight is bounded; I/O
+ * threads never block on it, past the bound the request is answered with 503
+ * right away. */
+typedef struct http_pool {
+  scheduler *sched;
+  atomic_int in_flight;
+  int capacity, threads;
+  void ***contexts; // per handler thread, indexed by scheduler_current_id()
+  struct http_server *server;
+} http_pool;
+
+// https://beej.us/guide/bgnet/pdf/bgnet_usl_c_1.pdf
 
 void free_http_request(http_request *request) {
   if (request == NULL) {
     return;
   }
+  compress_stream_free(request->_deflate);
+  if (request->_arena != NULL) {
+    // Everything it holds came from there, and nothing else does
+    arena_reset(request->_arena);
+    return;
+  }
   free(request->request_line);
   if (request->headers != NULL) {
-    // All pointers from all headers are into one contigous
-    // block, which we can free all at once
-    if (request->headers->_header_buf != NULL) {
-      free(request->headers->_header_buf);
-    }
+    // Keys and values point into the buffer the request was parsed from
     http_header *current = request->headers->head;
     while (current != NULL) {
       http_header *next_node = current->next;
@@ -68,125 +282,678 @@ void free_http_request(http_request *request) {
   free(request);
 }
 
-int http_parse_request(char *request_str, http_request *request) {
-  http_request_line *request_line = malloc(sizeof(http_request_line));
+/* Incremental request parser. It runs over the bytes of one request as they
+ * arrive and remembers where it stopped, so every byte is examined once no
+ * matter how the request was split across recv calls. Everything is recorded
+ * as offsets from the start of the request, which stay valid when the
+ * connection grows or compacts its buffer; http_parser_build turns them into
+ * an http_request once the whole request is there.
+ *
+ *  REQUEST_LINE --CRLF--> HEADERS --empty line-+-> BODY --length--> DONE
+ *                                              |
+ *       +--> CHUNK_SIZE --size 0--> TRAILERS --+--empty line--> DONE
+ *       |        |
+ *  CHUNK_END <-- CHUNK_DATA
+ *
+ * Chunked bodies are decoded in place: chunk data is moved down over the
+ * framing already consumed, so the body always sits contiguous at body_off.
+ * http_parser_reclaim gives back the bytes that frees.
+ */
+static void http_parser_reset(http_parser *p) {
+  http_header_span *spans = p->headers;
+  int cap = p->header_cap;
+  memset(p, 0, sizeof *p);
+  p->headers = spans;
+  p->header_cap = cap;
+}
 
-  http_request_headers *headers = malloc(sizeof(http_request_headers));
-  // defer allocating the body until we have a Content-Length header
-  // or something else
-  request->request_line = request_line;
-  request->headers = headers;
+static void http_parser_free(http_parser *p) {
+  free(p->headers);
+  p->headers = NULL;
+  p->header_cap = 0;
+}
 
-  // Begin RL parse -------
+static int http_parser_fail(http_parser *p, int status) {
+  p->state = HTTP_PARSE_ERROR;
+  p->status = status;
+  return -1;
+}
 
-  char *unparsed_rql = strtok(request_str, "\r\n");
-  request_str = strtok(NULL, "\0"); // save rest of request str for later
+/* Lines are found by scanning for their LF, and the first colon of a header
+ * line is picked up on the same pass. Scans resume at p->pos with what
+ * p->colon recorded, so a line split across reads is not scanned twice.
+ * Each scanner returns the offset of the LF in [pos, len), or -1 and leaves
+ * pos..len to be scanned again once more bytes are in. */
+static int http_scan_line_scalar(const char *buf, int pos, int len,
+                                 int *colon) {
+  const char *lf = memchr(buf + pos, '\n', len - pos);
+  int end = lf != NULL ? lf - buf : len;
+  if (*colon == 0) {
+    const char *c = memchr(buf + pos, ':', end - pos);
+    if (c != NULL)
+      *colon = c - buf;
+  }
+  return lf != NULL ? end : -1;
+}
 
-  char *undef_method = strtok(unparsed_rql, " ");
-  bool method_found = false;
-  for (int i = 0; i < (sizeof(http_method_str) / sizeof(http_method_str[0]));
-       i++) {
-    if (strcmp(undef_method, http_method_str[i]) == 0) {
-      request_line->method = (enum http_method)i;
-      method_found = true;
-      break;
+#ifdef HTTP_SIMD_X86
+// 32 bytes a stride: one compare each against LF and ':', and the masks say
+// where both are. Bytes short of a whole stride go to the scalar scanner.
+__attribute__((target("avx2"))) static int
+http_scan_line_avx2(const char *buf, int pos, int len, int *colon) {
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i cl = _mm256_set1_epi8(':');
+  for (; pos + 32 <= len; pos += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(buf + pos));
+    uint32_t lfs = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+    if (*colon == 0) {
+      uint32_t cls = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cl));
+      if (lfs != 0)
+        cls &= lfs - 1; // only those before the LF
+      if (cls != 0)
+        *colon = pos + __builtin_ctz(cls);
+    }
+    if (lfs != 0)
+      return pos + __builtin_ctz(lfs);
+  }
+  return http_scan_line_scalar(buf, pos, len, colon);
+}
+
+// 16 bytes a stride: PCMPESTRI finds the first byte that is any of LF and
+// ':', or just LF once the colon is known
+__attribute__((target("sse4.2"))) static int
+http_scan_line_sse42(const char *buf, int pos, int len, int *colon) {
+  const __m128i set = _mm_setr_epi8('\n', ':', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                    0, 0, 0, 0);
+  while (pos + 16 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + pos));
+    int i = _mm_cmpestri(set, *colon == 0 ? 2 : 1, v, 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                             _SIDD_LEAST_SIGNIFICANT);
+    if (i == 16) {
+      pos += 16;
+    } else if (buf[pos + i] == '\n') {
+      return pos + i;
+    } else {
+      *colon = pos + i;
+      pos += i + 1;
     }
   }
+  return http_scan_line_scalar(buf, pos, len, colon);
+}
+#endif
+
+static int http_scan_line(const char *buf, int pos, int len, int *colon) {
+#ifdef HTTP_SIMD_X86
+  if (__builtin_cpu_supports("avx2"))
+    return http_scan_line_avx2(buf, pos, len, colon);
+  if (__builtin_cpu_supports("sse4.2"))
+    return http_scan_line_sse42(buf, pos, len, colon);
+#endif
+  return http_scan_line_scalar(buf, pos, len, colon);
+}
+
+// Methods are told apart by their first byte and length, then confirmed
+static int http_lookup_method(const char *s, int len) {
+  int method;
+  switch (s[0]) {
+  case 'G':
+    method = GET;
+    break;
+  case 'H':
+    method = HEAD;
+    break;
+  case 'P':
+    method = len == 3 ? PUT : len == 4 ? POST : PATCH;
+    break;
+  case 'O':
+    method = OPTIONS;
+    break;
+  case 'T':
+    method = TRACE;
+    break;
+  case 'D':
+    method = DELETE;
+    break;
+  case 'C':
+    method = CONNECT;
+    break;
+  case 'L':
+    method = LINK;
+    break;
+  case 'U':
+    method = UNLINK;
+    break;
+  default:
+    return -1;
+  }
+  const char *name = http_method_str[method];
+  return (int)strlen(name) == len && memcmp(s, name, len) == 0 ? method : -1;
+}
+
+// Well-known header names are told apart by their length and first letter,
+// then confirmed
+static enum http_header_id http_header_lookup(const char *name, size_t len) {
+  enum http_header_id id;
+  int c = tolower((unsigned char)name[0]);
+  switch (len) {
+  case 4:
+    id = HTTP_HEADER_HOST;
+    break;
+  case 5:
+    id = HTTP_HEADER_RANGE;
+    break;
+  case 6:
+    id = c == 'a'   ? HTTP_HEADER_ACCEPT
+         : c == 'e' ? HTTP_HEADER_EXPECT
+                    : HTTP_HEADER_COOKIE;
+    break;
+  case 10:
+    id = c == 'c' ? HTTP_HEADER_CONNECTION : HTTP_HEADER_USER_AGENT;
+    break;
+  case 12:
+    id = HTTP_HEADER_CONTENT_TYPE;
+    break;
+  case 13:
+    id = c == 'a' ? HTTP_HEADER_AUTHORIZATION : HTTP_HEADER_IF_NONE_MATCH;
+    break;
+  case 14:
+    id = HTTP_HEADER_CONTENT_LENGTH;
+    break;
+  case 15:
+    id = HTTP_HEADER_ACCEPT_ENCODING;
+    break;
+  case 17:
+    id = c == 'i' ? HTTP_HEADER_IF_MODIFIED_SINCE
+                  : HTTP_HEADER_TRANSFER_ENCODING;
+    break;
+  default:
+    return HTTP_HEADER_OTHER;
+  }
+  return strncasecmp(name, http_header_str[id], len) == 0 ? id
+                                                          : HTTP_HEADER_OTHER;
+}
+
+// FNV-1a over the lowercased name
+static unsigned http_header_hash(const char *name, size_t len) {
+  unsigned hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619u;
+  return hash;
+}
 
-  if (!method_found) {
-    puts("Invalid request method");
+// Versions are all "HTTP/d.d", told apart by their digits
+static int http_lookup_version(const char *s, int len) {
+  if (len != 8)
+    return -1;
+  int version;
+  switch (s[5]) {
+  case '0':
+    version = HTTP_0_9;
+    break;
+  case '1':
+    version = s[7] == '0' ? HTTP_1_0 : HTTP_1_1;
+    break;
+  case '2':
+    version = HTTP_2_0;
+    break;
+  case '3':
+    version = HTTP_3_0;
+    break;
+  default:
     return -1;
   }
+  return memcmp(s, http_version_str[version], 8) == 0 ? version : -1;
+}
+
+static int http_parse_request_line(http_parser *p, const char *buf, int end) {
+  // METHOD SP Request-URI SP HTTP-Version
+  const char *line = buf + p->line;
+  const char *sp1 = memchr(line, ' ', end - p->line);
+  if (sp1 == NULL)
+    return http_parser_fail(p, HTTP_BAD_REQUEST);
+  const char *sp2 = memchr(sp1 + 1, ' ', buf + end - (sp1 + 1));
+  if (sp2 == NULL || sp2 == sp1 + 1)
+    return http_parser_fail(p, HTTP_BAD_REQUEST);
+
+  p->method = http_lookup_method(line, sp1 - line);
+  if (p->method == -1)
+    return http_parser_fail(p, HTTP_NOT_IMPLEMENTED);
+  p->uri_off = sp1 + 1 - buf;
+  p->uri_len = sp2 - (sp1 + 1);
+  p->version = http_lookup_version(sp2 + 1, buf + end - (sp2 + 1));
+  if (p->version == -1)
+    return http_parser_fail(p, HTTP_BAD_REQUEST);
+  return 0;
+}
+
+static int http_parse_header_line(http_parser *p, const char *buf, int end) {
+  // field-name ":" OWS field-value OWS
+  const char *line = buf + p->line;
+  const char *colon = p->colon != 0 ? buf + p->colon : NULL;
+  if (colon == NULL || colon == line)
+    return http_parser_fail(p, HTTP_BAD_REQUEST);
+
+  int key_len = colon - line;
+  while (key_len > 0 && (line[key_len - 1] == ' ' || line[key_len - 1] == '\t'))
+    key_len--;
+  int val_off = colon + 1 - buf;
+  int val_end = end;
+  while (val_off < val_end && (buf[val_off] == ' ' || buf[val_off] == '\t'))
+    val_off++;
+  while (val_end > val_off &&
+         (buf[val_end - 1] == ' ' || buf[val_end - 1] == '\t'))
+    val_end--;
+
+  if (p->header_count == p->header_cap) {
+    int cap = p->header_cap ? p->header_cap * 2 : 16;
+    http_header_span *spans = realloc(p->headers, cap * sizeof *spans);
+    if (spans == NULL)
+      return http_parser_fail(p, HTTP_HEADERS_TOO_LARGE);
+    p->headers = spans;
+    p->header_cap = cap;
+  }
+  enum http_header_id id = http_header_lookup(line, key_len);
+  p->headers[p->header_count++] = (http_header_span){
+      .key_off = p->line,
+      .key_len = key_len,
+      .val_off = val_off,
+      .val_len = val_end - val_off,
+      .id = id,
+  };
+
+  const char *value = buf + val_off;
+  int val_len = val_end - val_off;
+  if (id == HTTP_HEADER_CONTENT_LENGTH) {
+    char *num_end;
+    long length = strtol(value, &num_end, 10);
+    if (val_len == 0 || num_end != buf + val_end || length < 0 ||
+        (p->has_length && length != p->content_length))
+      return http_parser_fail(p, HTTP_BAD_REQUEST);
+    p->content_length = length;
+    p->has_length = true;
+  } else if (id == HTTP_HEADER_TRANSFER_ENCODING) {
+    // chunked is the only coding undone here, and it must come last
+    if (p->chunked || val_len < 7 ||
+        strncasecmp(value + val_len - 7, "chunked", 7) != 0)
+      return http_parser_fail(p, HTTP_NOT_IMPLEMENTED);
+    if (val_len > 7) // gzip, chunked and the like
+      return http_parser_fail(p, HTTP_NOT_IMPLEMENTED);
+    p->chunked = true;
+  } else if (id == HTTP_HEADER_EXPECT) {
+    p->expect_continue = val_len == 12 && strncasecmp(value, "100-continue",
+                                                      12) == 0;
+  }
+  // A length next to chunked coding is how requests get smuggled past
+  // proxies that pick the other one
+  if (p->chunked && p->has_length)
+    return http_parser_fail(p, HTTP_BAD_REQUEST);
+  return 0;
+}
+
+// chunk-size [ chunk-ext ], the size in hex
+static int http_parse_chunk_size(http_parser *p, const char *buf, int end,
+                                 const http_parser_limits *limits) {
+  long size = 0;
+  int i = p->line;
+  for (; i < end && isxdigit((unsigned char)buf[i]); i++) {
+    if (size > (LONG_MAX >> 4))
+      return http_parser_fail(p, HTTP_PAYLOAD_TOO_LARGE);
+    int c = tolower((unsigned char)buf[i]);
+    size = size * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+  }
+  if (i == p->line ||
+      (i < end && buf[i] != ';' && buf[i] != ' ' && buf[i] != '\t'))
+    return http_parser_fail(p, HTTP_BAD_REQUEST);
+  if (size > limits->max_body_size - p->body_read)
+    return http_parser_fail(p, HTTP_PAYLOAD_TOO_LARGE);
+  p->chunk_left = size;
+  p->state = size > 0 ? HTTP_PARSE_CHUNK_DATA : HTTP_PARSE_TRAILERS;
+  return 0;
+}
+
+// Takes up to want body bytes from what is buffered, returns how many
+static long http_parser_take(http_parser *p, char *buf, int len, long want) {
+  long n = len - p->pos < want ? len - p->pos : want;
+  int dst = p->body_off + p->body_len;
+  if (dst != p->pos)
+    memmove(buf + dst, buf + p->pos, n);
+  p->pos += n;
+  p->body_len += n;
+  p->body_read += n;
+  return n;
+}
 
-  request_line->request_uri = strtok(0, " ");
+// Advances over the len bytes of buf, which holds the request being parsed
+// from its first byte, and returns the new state. HTTP_PARSE_DONE means the
+// whole request (p->end bytes) is buffered; any state short of it means more
+// bytes are needed.
+static enum http_parse_state
+http_parser_execute(http_parser *p, char *buf, int len,
+                    const http_parser_limits *limits) {
+  while (p->state != HTTP_PARSE_DONE && p->state != HTTP_PARSE_ERROR) {
+    if (p->state == HTTP_PARSE_BODY) {
+      long want = p->content_length - p->body_read;
+      if (http_parser_take(p, buf, len, want) < want)
+        break;
+      p->end = p->pos;
+      p->state = HTTP_PARSE_DONE;
+      break;
+    }
+    if (p->state == HTTP_PARSE_CHUNK_DATA) {
+      p->chunk_left -= http_parser_take(p, buf, len, p->chunk_left);
+      if (p->chunk_left > 0)
+        break;
+      p->line = p->pos;
+      p->colon = 0;
+      p->state = HTTP_PARSE_CHUNK_END;
+      continue;
+    }
 
-  char *undef_vers = strtok(NULL, "\0");
-  bool version_found = false;
-  for (int i = 0; i < (sizeof(http_version_str) / sizeof(http_version_str[0]));
-       i++) {
-    if (strcmp(undef_vers, http_version_str[i]) == 0) {
-      request_line->http_version = (enum http_version)i;
-      version_found = true;
+    // Everything else is read a line at a time
+    bool in_headers = p->state < HTTP_PARSE_BODY;
+    int lf = http_scan_line(buf, p->pos, len, &p->colon);
+    p->pos = lf != -1 ? lf + 1 : len;
+    if (in_headers && p->pos > limits->max_header_size)
+      http_parser_fail(p, HTTP_HEADERS_TOO_LARGE);
+    else if (!in_headers && p->pos - p->line > HTTP_MAX_CHUNK_LINE)
+      http_parser_fail(p, HTTP_BAD_REQUEST);
+    if (lf == -1 || p->state == HTTP_PARSE_ERROR)
+      break;
+    int end = lf; // line content is [p->line, end), minus any CR
+    if (end > p->line && buf[end - 1] == '\r')
+      end--;
+
+    switch (p->state) {
+    case HTTP_PARSE_REQUEST_LINE:
+      // An empty line here is a stray CRLF between requests, skip it
+      if (end > p->line && http_parse_request_line(p, buf, end) == 0)
+        p->state = HTTP_PARSE_HEADERS;
+      break;
+    case HTTP_PARSE_HEADERS:
+      if (end > p->line) {
+        http_parse_header_line(p, buf, end);
+        break;
+      }
+      p->body_off = p->pos;
+      p->state = p->chunked ? HTTP_PARSE_CHUNK_SIZE : HTTP_PARSE_BODY;
+      if (p->content_length > limits->max_body_size)
+        http_parser_fail(p, HTTP_PAYLOAD_TOO_LARGE);
+      break;
+    case HTTP_PARSE_CHUNK_SIZE:
+      http_parse_chunk_size(p, buf, end, limits);
+      break;
+    case HTTP_PARSE_CHUNK_END:
+      if (end > p->line)
+        http_parser_fail(p, HTTP_BAD_REQUEST);
+      else
+        p->state = HTTP_PARSE_CHUNK_SIZE;
+      break;
+    case HTTP_PARSE_TRAILERS:
+      // Trailer fields are not kept
+      if (end == p->line) {
+        p->end = p->pos;
+        p->state = HTTP_PARSE_DONE;
+      }
+      break;
+    default:
       break;
     }
+    p->line = p->pos;
+    p->colon = 0;
   }
+  return p->state;
+}
+
+// Drops the bytes of a body in progress that are no longer needed: chunk
+// framing already decoded and, with consumed set, the decoded body itself
+// once it has been handed off. Returns how many bytes buf shrank by; bytes
+// after them are moved down.
+static int http_parser_reclaim(http_parser *p, char *buf, int len,
+                               bool consumed) {
+  if (p->state <= HTTP_PARSE_HEADERS || p->state >= HTTP_PARSE_DONE)
+    return 0;
+  if (consumed)
+    p->body_len = 0;
+  int keep = p->body_off + p->body_len;
+  // A partial line is rescanned, chunk data is taken as it comes
+  int from = p->state == HTTP_PARSE_CHUNK_DATA || p->state == HTTP_PARSE_BODY
+                 ? p->pos
+                 : p->line;
+  int gap = from - keep;
+  if (gap <= 0)
+    return 0;
+  memmove(buf + keep, buf + from, len - from);
+  p->pos -= gap;
+  p->line -= gap;
+  return gap;
+}
+
+static void *http_request_alloc(http_request *request, size_t size) {
+  return request->_arena != NULL ? arena_alloc(request->_arena, size)
+                                 : malloc(size);
+}
 
-  if (!version_found) {
-    puts("Invalid request HTTP version");
+// Fills request from a parse of buf that got past the headers. Tokens and,
+// with_body set, the body are NUL-terminated in place, so the request borrows
+// buf; the byte at p->end must already be NUL. Without with_body the body is
+// left empty and the bytes after the headers are not touched. The parts of
+// the request come from request->_arena when it has one.
+static int http_parser_build(http_parser *p, char *buf, http_request *request,
+                             bool with_body) {
+  http_request_line *request_line =
+      http_request_alloc(request, sizeof(http_request_line));
+  http_request_headers *headers =
+      http_request_alloc(request, sizeof(http_request_headers));
+  request->request_line = request_line;
+  request->headers = headers;
+  if (request_line == NULL || headers == NULL)
     return -1;
+  *headers = (http_request_headers){0};
+
+  request_line->method = (enum http_method)p->method;
+  request_line->request_uri = buf + p->uri_off;
+  request_line->request_uri[p->uri_len] = '\0';
+  request_line->http_version = (enum http_version)p->version;
+
+  headers->_bufsize = p->body_off + 1;
+  for (int i = 0; i < p->header_count; i++) {
+    http_header_span *span = &p->headers[i];
+    http_header *header = http_request_alloc(request, sizeof(http_header));
+    if (header == NULL)
+      return -1;
+    header->key = buf + span->key_off;
+    header->key[span->key_len] = '\0';
+    header->value = buf + span->val_off;
+    header->value[span->val_len] = '\0';
+    header->next = NULL;
+    header->_next_hash = NULL;
+    if (headers->tail != NULL)
+      headers->tail->next = header;
+    else
+      headers->head = header;
+    headers->tail = header;
+    headers->size++;
+    if (span->id != HTTP_HEADER_OTHER) {
+      if (headers->known[span->id] == NULL)
+        headers->known[span->id] = header;
+      continue;
+    }
+    http_header **slot =
+        &headers->_table[http_header_hash(header->key, span->key_len) &
+                         (HTTP_HEADER_TABLE_SIZE - 1)];
+    while (*slot != NULL)
+      slot = &(*slot)->_next_hash;
+    *slot = header;
   }
 
-  // End of RL parse --------
-
-  // Begin HEAD parse -------
-
-  /* General idea is allocate size equal to the string that contains ALL
-   * headers, then, each http_header in the http_request_headers linked-list
-   * will point to a segment of that allocated memory, with each segment being a
-   * null-terminated string. Essentially:
-   *
-   *  {key,value,next}  {key,value,next}
-   *    ╱   │      └────⬏
-   *   ╱    │
-   *  ↙     ↓
-   * "Host\0localhost:8080\0..."   // Post-Parse
-   * "Host: localhost:8080\r\n..." // Original Malloc/Copy
-   *
-   * Via RFC 1945 (HTTP 1.0):
-   * HTTP-header    = field-name ":" [ field-value ] CRLF
-   */
-
-  char *end_of_headers = strstr(
-      request_str, "\r\n\r\n"); // empty CRLF line indicates end of headers
-  if (end_of_headers == NULL) {
+  if (!with_body) {
+    request->body = "";
+    return 0;
+  }
+  request->body = buf + p->body_off;
+  request->body[p->body_len] = '\0';
+  request->body_len = p->body_len;
+  return 0;
+}
+
+// Points a request built by http_parser_build back into buf after the buffer
+// it was parsed from moved
+static void http_parser_rebind(http_parser *p, char *buf,
+                               http_request *request) {
+  request->request_line->request_uri = buf + p->uri_off;
+  http_header *header = request->headers->head;
+  for (int i = 0; header != NULL; i++, header = header->next) {
+    header->key = buf + p->headers[i].key_off;
+    header->value = buf + p->headers[i].val_off;
+  }
+}
+
+int http_parse_request(char *request_str, http_request *request) {
+  http_parser parser = {0};
+  http_parser_limits limits = {.max_header_size = INT_MAX,
+                               .max_body_size = LONG_MAX};
+  int len = strlen(request_str);
+  request->_arena = NULL;
+  request->_deflate = NULL;
+  request->_aborted = false;
+
+  enum http_parse_state state =
+      http_parser_execute(&parser, request_str, len, &limits);
+  // A lone string has nothing more coming: the body is whatever is left
+  if (state <= HTTP_PARSE_HEADERS || state == HTTP_PARSE_ERROR ||
+      http_parser_build(&parser, request_str, request, true) != 0) {
+    http_parser_free(&parser);
     return -1;
   }
-  size_t headers_total_size = end_of_headers - request_str + 1;
-  headers->_bufsize = headers_total_size;
+  http_parser_free(&parser);
+  return 0;
+}
+
+const char *http_get_known_header(const struct http_request *request,
+                                  enum http_header_id id) {
+  if (request->headers == NULL || id < 0 || id >= HTTP_HEADER_OTHER ||
+      request->headers->known[id] == NULL)
+    return NULL;
+  return request->headers->known[id]->value;
+}
+
+const char *http_get_header(const struct http_request *request,
+                            const char *name) {
+  size_t len = strlen(name);
+  enum http_header_id id = http_header_lookup(name, len);
+  if (id != HTTP_HEADER_OTHER)
+    return http_get_known_header(request, id);
+  if (request->headers == NULL)
+    return NULL;
+  http_header *header = request->headers->_table[http_header_hash(name, len) &
+                                                 (HTTP_HEADER_TABLE_SIZE - 1)];
+  for (; header != NULL; header = header->_next_hash)
+    if (strcasecmp(header->key, name) == 0)
+      return header->value;
+  return NULL;
+}
 
-  char *header_buf = malloc(headers_total_size * sizeof(char));
-  headers->_header_buf = header_buf;
-  memcpy(header_buf, request_str, headers_total_size);
+/* Query strings are left as they arrived: pairs are found by scanning for
+ * '&' and '=' and handed out as slices of the URI, and only a value that is
+ * read gets decoded, into a buffer the caller provides. */
+void http_query_init(http_query *query, const char *uri) {
+  const char *start = strchr(uri, '?');
+  if (start == NULL) {
+    query->next = query->end = NULL;
+    return;
+  }
+  query->next = start + 1;
+  query->end = query->next + strcspn(query->next, "#");
+}
 
-  request->body = end_of_headers + 4; // new unparsed str is body only
+bool http_query_next(http_query *query, http_query_param *param) {
+  while (query->next < query->end) {
+    const char *pair = query->next;
+    const char *amp = memchr(pair, '&', query->end - pair);
+    const char *pair_end = amp != NULL ? amp : query->end;
+    query->next = amp != NULL ? amp + 1 : query->end;
+    if (pair_end == pair)
+      continue; // as in a&&b
+    const char *eq = memchr(pair, '=', pair_end - pair);
+    param->key = pair;
+    param->key_len = (eq != NULL ? eq : pair_end) - pair;
+    param->value = eq != NULL ? eq + 1 : pair_end;
+    param->value_len = pair_end - param->value;
+    return true;
+  }
+  return false;
+}
 
-  char *token = strtok(header_buf, ":"); // get key split
-  strip_whitespace(token);
+static int http_hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c = tolower((unsigned char)c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
 
-  http_header *first = malloc(sizeof(http_header));
-  first->key = token;
-  first->next = NULL;
-  headers->head = first;
-  headers->tail = first;
-  headers->size = 1;
+// Decodes the character at src[*i] and steps *i past its encoding
+static unsigned char http_query_char(const char *src, size_t len, size_t *i) {
+  unsigned char c = src[(*i)++];
+  if (c == '+')
+    return ' ';
+  if (c == '%' && *i + 2 <= len) {
+    int hi = http_hex_digit(src[*i]), lo = http_hex_digit(src[*i + 1]);
+    if (hi != -1 && lo != -1) {
+      *i += 2;
+      return hi << 4 | lo;
+    }
+  }
+  return c;
+}
 
-  for (;;) {
-    headers->tail->value = strtok(0, "\r\n");
-    strip_whitespace(headers->tail->value);
-    if (!token)
-      break;
-    token = strtok(NULL, ":"); // get key of current
-    strip_whitespace(token);
-    if (!token)
-      break;
-    http_header *current =
-        malloc(sizeof(http_header)); // create current with key
-    current->key = token;
-    current->next = NULL;
-    headers->tail->next = current; // link struct
-    headers->tail = current;       // readdress tail
-    headers->size += 1;
-  };
+long http_query_decode(const char *src, size_t len, char *dst, size_t size) {
+  size_t n = 0;
+  if (memchr(src, '%', len) == NULL && memchr(src, '+', len) == NULL) {
+    // Nothing to decode
+    if (len >= size)
+      return -1;
+    memcpy(dst, src, len);
+    n = len;
+  } else {
+    for (size_t i = 0; i < len;) {
+      if (n + 1 >= size)
+        return -1;
+      dst[n++] = http_query_char(src, len, &i);
+    }
+  }
+  dst[n] = '\0';
+  return n;
+}
 
-  // End HEAD parse ---------
+// Compares an encoded key to a plain one, decoding as it goes
+static bool http_query_key_is(const char *src, size_t len, const char *key) {
+  for (size_t i = 0; i < len; key++)
+    if (*key == '\0' || http_query_char(src, len, &i) != (unsigned char)*key)
+      return false;
+  return *key == '\0';
+}
 
-  return 0;
+long http_query_get(const struct http_request *request, const char *key,
+                    char *buf, size_t size) {
+  http_query query;
+  http_query_param param;
+  http_query_init(&query, request->request_line->request_uri);
+  while (http_query_next(&query, &param))
+    if (http_query_key_is(param.key, param.key_len, key)) {
+      long len = http_query_decode(param.value, param.value_len, buf, size);
+      return len < 0 ? -2 : len;
+    }
+  return -1;
 }
 
 char *http_headers_to_string(struct http_request_headers *headers,
                              bool pretty_print) {
   int offset = 0;
   char *out = malloc(headers->_bufsize * sizeof(char));
+  if (out == NULL)
+    return NULL;
+  out[0] = '\0'; // a request may have no headers at all
   http_header *current = headers->head;
   while (current != NULL) {
     offset += snprintf(out + offset, headers->_bufsize - offset,
@@ -197,12 +964,144 @@ char *http_headers_to_string(struct http_request_headers *headers,
   return out;
 }
 
+void http_server_default_options(http_server_options *options) {
+  memset(options, 0, sizeof *options);
+  options->keepalive_max_requests = HTTP_KEEPALIVE_MAX_REQUESTS;
+  options->keepalive_timeout_ms = HTTP_KEEPALIVE_TIMEOUT_MS;
+  options->header_timeout_ms = HTTP_HEADER_TIMEOUT_MS;
+  options->body_timeout_ms = HTTP_BODY_TIMEOUT_MS;
+  options->max_header_size = HTTP_MAX_HEADER_SIZE;
+  options->max_body_size = HTTP_MAX_BODY_SIZE;
+#ifdef __linux__
+  options->backend = HTTP_BACKEND_EPOLL;
+#else
+  options->backend = HTTP_BACKEND_POLL;
+#endif
+}
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Creates, binds and listens on a socket for server->res, exits on failure
+static int http_open_listener(struct http_server *server, bool reuseport) {
+  int fd = socket(server->res->ai_family, server->res->ai_socktype,
+                  server->res->ai_protocol);
+
+  if (fd == -1) {
+    perror("_socket");
+    exit(1);
+  }
+  int yes = 1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+  if (reuseport &&
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+    perror("SO_REUSEPORT");
+    close(fd);
+    exit(1);
+  }
+
+#ifdef TCP_DEFER_ACCEPT
+  if (server->defer_accept_s > 0 &&
+      setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &server->defer_accept_s,
+                 sizeof(int)) == -1)
+    perror("TCP_DEFER_ACCEPT"); // only costs the early wakeups
+#endif
+
+  if (bind(fd, server->res->ai_addr, server->res->ai_addrlen) == -1) {
+    perror("bind");
+    close(fd);
+    exit(1);
+  }
+
+  if (listen(fd, server->listen_backlog) == -1) {
+    perror("listen");
+    close(fd);
+    exit(1);
+  }
+
+  if (set_nonblocking(fd) == -1) {
+    perror("fcntl");
+    close(fd);
+    exit(1);
+  }
+  return fd;
+}
+
+// Asks the server at path for its listening sockets, which are stored in
+// fds. Returns how many it sent, 0 when no server answered.
+static int http_handoff_receive(const char *path, int *fds) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof addr.sun_path)
+    return 0;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return 0;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1) {
+    close(fd);
+    return 0;
+  }
+
+  int count = 0;
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HTTP_HANDOFF_MAX)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {.iov_base = &count, .iov_len = sizeof count};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof control.buf};
+  ssize_t n;
+  while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+    ;
+  int received = 0;
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), received * sizeof(int));
+  }
+  if (n != sizeof count || received != count || count == 0) {
+    for (int i = 0; i < received; i++)
+      close(fds[i]);
+    received = 0;
+  } else {
+    // The old server keeps accepting until it hears this process has them
+    char ack = 0;
+    while (write(fd, &ack, 1) == -1 && errno == EINTR)
+      ;
+  }
+  close(fd);
+  return received;
+}
+
 http_server http_server_init(char *port,
                              void (*entrypoint)(http_request *, void **),
-                             void **context) {
+                             void **context,
+                             const http_server_options *options) {
   http_server server = {0};
+  http_server_options defaults;
+
+  if (options == NULL) {
+    http_server_default_options(&defaults);
+    options = &defaults;
+  }
 
   server.concurrent_connections = 1;
+  server.backend = options->backend;
+#ifndef HTTP_WITH_URING
+  if (server.backend == HTTP_BACKEND_IO_URING)
+    server.backend = HTTP_BACKEND_EPOLL;
+#endif
+#ifndef __linux__
+  server.backend = HTTP_BACKEND_POLL;
+#endif
 
   memset(&server._hints, 0, sizeof server._hints);
   server._hints.ai_family = AF_UNSPEC;     // Any IP v4/v6
@@ -214,30 +1113,101 @@ http_server http_server_init(char *port,
     exit(1);
   }
 
-  server._socket = socket(server.res->ai_family, server.res->ai_socktype,
-                          server.res->ai_protocol);
+  server.listen_backlog = options->listen_backlog > 0 ? options->listen_backlog
+                                                      : HTTP_LISTEN_BACKLOG;
+  server.defer_accept_s = options->defer_accept_s;
 
-  if (server._socket == -1) {
-    perror("_socket");
-    exit(1);
+  int workers = options->workers;
+  if (workers == HTTP_WORKERS_AUTO) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cores > 0 ? cores : 1;
   }
-  int yes = 1;
-
-  setsockopt(server._socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-
-  if (bind(server._socket, server.res->ai_addr, server.res->ai_addrlen) == -1) {
-    perror("bind");
-    close(server._socket);
+  if (workers < 1)
+    workers = 1;
+
+  // Sockets taken over from a running server are all served, even by fewer
+  // workers than asked for: connections the kernel queued on one nobody
+  // accepts from would be lost
+  int inherited[HTTP_HANDOFF_MAX];
+  int inherited_count = 0;
+  server.handoff_path = options->handoff_path;
+  if (server.handoff_path != NULL)
+    inherited_count = http_handoff_receive(server.handoff_path, inherited);
+  if (workers < inherited_count)
+    workers = inherited_count;
+
+  // Every worker gets its own listening socket; with more than one they all
+  // bind the same port through SO_REUSEPORT and the kernel spreads incoming
+  // connections between them.
+  server._worker_count = workers;
+  server._workers = calloc(workers, sizeof(http_worker));
+  if (server._workers == NULL) {
+    perror("calloc");
     exit(1);
   }
-
-  if (listen(server._socket, 5) == -1) {
-    perror("listen");
-    close(server._socket);
-    exit(1);
+  server._listener_count = inherited_count > 0 ? inherited_count : workers;
+  for (int i = 0; i < workers; i++) {
+    server._workers[i].id = i;
+    if (inherited_count > 0)
+      server._workers[i].socket = inherited[i % inherited_count];
+    else
+      server._workers[i].socket = http_open_listener(&server, workers > 1);
   }
-  if (listen(server._socket, 5))
+  server._socket = server._workers[0].socket;
+  server.worker_context = options->worker_context;
+  server.worker_context_free = options->worker_context_free;
+  server.handler_threads = options->handler_threads;
+  server.keepalive_max_requests = options->keepalive_max_requests;
+  server.keepalive_timeout_ms = options->keepalive_timeout_ms;
+  server.header_timeout_ms = options->header_timeout_ms != 0
+                                 ? options->header_timeout_ms
+                                 : HTTP_HEADER_TIMEOUT_MS;
+  server.body_timeout_ms = options->body_timeout_ms != 0
+                               ? options->body_timeout_ms
+                               : HTTP_BODY_TIMEOUT_MS;
+  server.max_header_size = options->max_header_size > 0
+                               ? options->max_header_size
+                               : HTTP_MAX_HEADER_SIZE;
+  server.max_body_size =
+      options->max_body_size > 0 ? options->max_body_size : HTTP_MAX_BODY_SIZE;
+  // Buffer offsets are ints; leave room for a request's headers and body
+  if (server.max_header_size > INT_MAX / 4)
+    server.max_header_size = INT_MAX / 4;
+  if (server.max_body_size > INT_MAX / 4)
+    server.max_body_size = INT_MAX / 4;
+  server.handler_queue = options->handler_queue > 0 ? options->handler_queue
+                                                    : HTTP_HANDLER_QUEUE;
+  server.body_handler = options->body_handler;
+  if (options->static_prefix != NULL && options->static_root != NULL) {
+    server.static_prefix = options->static_prefix;
+    server.static_root = options->static_root;
+  }
+  if (server.backend != HTTP_BACKEND_IO_URING)
+    server.zerocopy_threshold = options->zerocopy_threshold;
+  server._files = filecache_create(options->file_cache_size > 0
+                                       ? options->file_cache_size
+                                       : HTTP_FILE_CACHE_SIZE,
+                                   HTTP_FILE_CACHE_TTL_MS);
+  if (server._files == NULL) {
+    perror("filecache_create");
     exit(1);
+  }
+#ifdef HTTP_WITH_ZLIB
+  server.compress_min_size = options->compress_min_size;
+#endif
+  server.compress_level =
+      options->compress_level >= 1 && options->compress_level <= 9
+          ? options->compress_level
+          : HTTP_COMPRESS_LEVEL;
+  if (server.compress_min_size > 0 && options->compress_cache_size >= 0) {
+    server._compressed = compress_cache_create(
+        options->compress_cache_size > 0 ? options->compress_cache_size
+                                         : HTTP_COMPRESS_CACHE_SIZE);
+    if (server._compressed == NULL) {
+      perror("compress_cache_create");
+      exit(1);
+    }
+  }
 
   server.entrypoint = entrypoint;
   server.context = context;
@@ -245,11 +1215,13 @@ http_server http_server_init(char *port,
   return server;
 }
 
-void add_to_pfds(struct pollfd **pfds, int newfd, int *fd_count, int *fd_size) {
+void add_to_pfds(struct pollfd **pfds, http_connection ***conns, int newfd,
+                 http_connection *conn, int *fd_count, int *fd_size) {
   if (*fd_count == *fd_size) {
     *fd_size *= 2;
     *pfds = realloc(*pfds, sizeof(struct pollfd) * (*fd_size));
-    if (*pfds == NULL) {
+    *conns = realloc(*conns, sizeof(http_connection *) * (*fd_size));
+    if (*pfds == NULL || *conns == NULL) {
       perror("realloc");
       exit(1);
     }
@@ -257,138 +1229,2341 @@ void add_to_pfds(struct pollfd **pfds, int newfd, int *fd_count, int *fd_size) {
 
   (*pfds)[*fd_count].fd = newfd;
   (*pfds)[*fd_count].events = POLLIN;
+  (*conns)[*fd_count] = conn;
+  if (conn != NULL)
+    conn->poll_index = *fd_count;
 
   (*fd_count)++;
 }
 
-void del_from_pfds(struct pollfd pfds[], int i, int *fd_count) {
-  pfds[i] = pfds[*fd_count - 1];
+void del_from_pfds(struct pollfd pfds[], http_connection *conns[], int i,
+                   int *fd_count) {
   (*fd_count)--;
+  pfds[i] = pfds[*fd_count];
+  conns[i] = conns[*fd_count];
+  // conns[i] may already be freed when it was the last entry
+  if (i < *fd_count && conns[i] != NULL)
+    conns[i]->poll_index = i;
+}
+
+static size_t http_headers_len(const struct http_response *response) {
+  if (response->_headers_cap > 0)
+    return response->_headers_len;
+  // Set by the caller rather than built here
+  return response->headers != NULL ? strlen(response->headers) : 0;
+}
+
+// Writes n in decimal at dst and returns how many digits that took
+static size_t http_format_uint(char *dst, unsigned long long n) {
+  char digits[20];
+  size_t len = 0;
+  do {
+    digits[sizeof digits - ++len] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  memcpy(dst, digits + sizeof digits - len, len);
+  return len;
+}
+
+static char *http_put(char *dst, const char *src, size_t len) {
+  memcpy(dst, src, len);
+  return dst + len;
 }
 
-char *http_encode_response(struct http_response *response) {
-  const char *headers = response->headers ? response->headers : "";
-  const char *body = response->body ? response->body : "";
-  int len = 0;
-  char *str = NULL;
+#define HTTP_PUT_LITERAL(dst, s) http_put(dst, s, sizeof s - 1)
+
+typedef struct http_status_line {
+  const char *line;
+  size_t len;
+} http_status_line;
+
+#define HTTP_STATUS_LINE(code, reason)                                         \
+  [code] = {"HTTP/1.1 " #code " " reason "\r\n",                               \
+            sizeof "HTTP/1.1 " #code " " reason "\r\n" - 1}
+
+// Status lines ready to copy, reason phrases from RFC 9110
+static const http_status_line http_status_lines[] = {
+    HTTP_STATUS_LINE(100, "Continue"),
+    HTTP_STATUS_LINE(101, "Switching Protocols"),
+    HTTP_STATUS_LINE(200, "OK"),
+    HTTP_STATUS_LINE(201, "Created"),
+    HTTP_STATUS_LINE(202, "Accepted"),
+    HTTP_STATUS_LINE(203, "Non-Authoritative Information"),
+    HTTP_STATUS_LINE(204, "No Content"),
+    HTTP_STATUS_LINE(205, "Reset Content"),
+    HTTP_STATUS_LINE(206, "Partial Content"),
+    HTTP_STATUS_LINE(300, "Multiple Choices"),
+    HTTP_STATUS_LINE(301, "Moved Permanently"),
+    HTTP_STATUS_LINE(302, "Found"),
+    HTTP_STATUS_LINE(303, "See Other"),
+    HTTP_STATUS_LINE(304, "Not Modified"),
+    HTTP_STATUS_LINE(307, "Temporary Redirect"),
+    HTTP_STATUS_LINE(308, "Permanent Redirect"),
+    HTTP_STATUS_LINE(400, "Bad Request"),
+    HTTP_STATUS_LINE(401, "Unauthorized"),
+    HTTP_STATUS_LINE(403, "Forbidden"),
+    HTTP_STATUS_LINE(404, "Not Found"),
+    HTTP_STATUS_LINE(405, "Method Not Allowed"),
+    HTTP_STATUS_LINE(406, "Not Acceptable"),
+    HTTP_STATUS_LINE(408, "Request Timeout"),
+    HTTP_STATUS_LINE(409, "Conflict"),
+    HTTP_STATUS_LINE(410, "Gone"),
+    HTTP_STATUS_LINE(411, "Length Required"),
+    HTTP_STATUS_LINE(412, "Precondition Failed"),
+    HTTP_STATUS_LINE(413, "Content Too Large"),
+    HTTP_STATUS_LINE(414, "URI Too Long"),
+    HTTP_STATUS_LINE(415, "Unsupported Media Type"),
+    HTTP_STATUS_LINE(416, "Range Not Satisfiable"),
+    HTTP_STATUS_LINE(417, "Expectation Failed"),
+    HTTP_STATUS_LINE(422, "Unprocessable Content"),
+    HTTP_STATUS_LINE(426, "Upgrade Required"),
+    HTTP_STATUS_LINE(428, "Precondition Required"),
+    HTTP_STATUS_LINE(429, "Too Many Requests"),
+    HTTP_STATUS_LINE(431, "Request Header Fields Too Large"),
+    HTTP_STATUS_LINE(500, "Internal Server Error"),
+    HTTP_STATUS_LINE(501, "Not Implemented"),
+    HTTP_STATUS_LINE(502, "Bad Gateway"),
+    HTTP_STATUS_LINE(503, "Service Unavailable"),
+    HTTP_STATUS_LINE(504, "Gateway Timeout"),
+    HTTP_STATUS_LINE(505, "HTTP Version Not Supported"),
+};
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+#define HTTP_DATE_LEN 37
+
+/* Date header for the current second. Every thread that encodes responses
+ * (I/O workers and handler threads alike) keeps its own copy and formats it
+ * again only once the second has changed, so responses copy it instead of
+ * formatting a date each, and no thread reads a copy another is writing. */
+static const char *http_date_header(void) {
+  static const char *const days[] = {"Sun", "Mon", "Tue", "Wed",
+                                     "Thu", "Fri", "Sat"};
+  static const char *const months[] = {"Jan", "Feb", "Mar", "Apr",
+                                       "May", "Jun", "Jul", "Aug",
+                                       "Sep", "Oct", "Nov", "Dec"};
+  static _Thread_local char header[64]; // what snprintf may need for any tm
+  static _Thread_local time_t formatted = -1;
+  time_t now = time(NULL);
+  if (now != formatted) {
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    snprintf(header, sizeof header,
+             "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+             days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+             tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    formatted = now;
+  }
+  return header;
+}
 
-  len = snprintf(NULL, 0, "HTTP/1.1 %d\x0d\x0a%s\x0d\x0a%s", response->status,
-                 headers, body);
-  str = malloc(len + 1);
-  if (str == NULL) {
+// How a response's body goes out, as far as its head tells the client
+typedef struct http_framing {
+  long long content_length; // < 0 when not known up front
+  bool chunked;
+  const char *content_encoding; // NULL when sent as is
+  bool vary; // the body depends on Accept-Encoding
+} http_framing;
+
+/* Encodes the status line, Date, the response's headers and the ones
+ * framing it (Content-Type, Content-Encoding, Vary, Content-Length,
+ * Transfer-Encoding, and Connection as conn will be left) into one buffer
+ * sized for all of them up front, followed by room for reserve more bytes.
+ * Sets *len to the length of the head alone. */
+static char *http_encode_head(struct http_response *response,
+                              http_connection *conn,
+                              const http_framing *framing, size_t reserve,
+                              size_t *len) {
+  int status = response->status;
+  bool known = status >= 0 &&
+               status < (int)(sizeof http_status_lines /
+                              sizeof http_status_lines[0]) &&
+               http_status_lines[status].line != NULL;
+  size_t headers_len = http_headers_len(response);
+  size_t type_len =
+      response->content_type != NULL ? strlen(response->content_type) : 0;
+  size_t encoding_len = framing->content_encoding != NULL
+                            ? strlen(framing->content_encoding)
+                            : 0;
+  bool keep_alive = conn != NULL && conn->keep_alive;
+  size_t max = (known ? http_status_lines[status].len
+                      : sizeof "HTTP/1.1  \r\n" + 10) +
+               HTTP_DATE_LEN + headers_len +
+               sizeof "Content-Type: \r\n" + type_len +
+               sizeof "Content-Encoding: \r\n" + encoding_len +
+               sizeof "Vary: Accept-Encoding\r\n" +
+               sizeof "Content-Length: \r\n" + 20 +
+               sizeof "Transfer-Encoding: chunked\r\n" +
+               sizeof "Connection: keep-alive\r\n" + 2;
+  char *head = malloc(max + reserve);
+  if (head == NULL) {
     perror("malloc");
     return NULL;
   }
-  snprintf(str, len + 1, "HTTP/1.1 %d\x0d\x0a%s\x0d\x0a%s", response->status,
-           headers, body);
-  return str;
+
+  char *p = head;
+  if (known) {
+    p = http_put(p, http_status_lines[status].line,
+                 http_status_lines[status].len);
+  } else {
+    // Without a reason phrase, whose space must still be there
+    p = HTTP_PUT_LITERAL(p, "HTTP/1.1 ");
+    p += http_format_uint(p, (unsigned)status);
+    p = HTTP_PUT_LITERAL(p, " \r\n");
+  }
+  p = http_put(p, http_date_header(), HTTP_DATE_LEN);
+  if (headers_len > 0)
+    p = http_put(p, response->headers, headers_len);
+  if (response->content_type != NULL) {
+    p = HTTP_PUT_LITERAL(p, "Content-Type: ");
+    p = http_put(p, response->content_type, type_len);
+    p = HTTP_PUT_LITERAL(p, "\r\n");
+  }
+  if (framing->content_encoding != NULL) {
+    p = HTTP_PUT_LITERAL(p, "Content-Encoding: ");
+    p = http_put(p, framing->content_encoding, encoding_len);
+    p = HTTP_PUT_LITERAL(p, "\r\n");
+  }
+  if (framing->vary)
+    p = HTTP_PUT_LITERAL(p, "Vary: Accept-Encoding\r\n");
+  if (framing->content_length >= 0) {
+    p = HTTP_PUT_LITERAL(p, "Content-Length: ");
+    p += http_format_uint(p, framing->content_length);
+    p = HTTP_PUT_LITERAL(p, "\r\n");
+  }
+  if (framing->chunked)
+    p = HTTP_PUT_LITERAL(p, "Transfer-Encoding: chunked\r\n");
+  p = keep_alive ? HTTP_PUT_LITERAL(p, "Connection: keep-alive\r\n")
+                 : HTTP_PUT_LITERAL(p, "Connection: close\r\n");
+  p = HTTP_PUT_LITERAL(p, "\r\n");
+  *len = p - head;
+  return head;
+}
+
+// Sends every iovec, waiting for the non-blocking socket to drain when needed
+static int http_send_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        if (poll(&pfd, 1, -1) != -1 || errno == EINTR)
+          continue;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (; count > 0 && (size_t)n >= iov->iov_len; count--, iov++)
+      n -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+static void http_out_append(http_connection *conn, http_out *out) {
+  if (conn->out_tail != NULL)
+    conn->out_tail->next = out;
+  else
+    conn->out_head = out;
+  conn->out_tail = out;
 }
-int http_respond(struct http_response *response, struct http_request *request) {
-  if (response->body == NULL)
-    return -1;
-  char *buf = malloc(sizeof(char) *
-                     (snprintf(0, 0, "%ld", strlen(response->body)) + 2));
-  sprintf(buf, "%ld", strlen(response->body));
 
-  http_set_response_header(response, "Content-Length", buf);
+// Appends malloc'd data to the connection's output queue, which takes it over
+static int http_connection_queue(http_connection *conn, char *data,
+                                 size_t len) {
+  http_out *out = malloc(sizeof(http_out));
+  if (out == NULL) {
+    free(data);
+    return -1;
+  }
+  *out = (http_out){.data = data, .len = len};
+  http_out_append(conn, out);
+  return 0;
+}
 
-  char *response_string = http_encode_response(response);
+static int http_connection_send_iov(http_connection *conn,
+                                    const struct iovec *iov, int count);
+static int http_connection_queue_iov(http_connection *conn,
+                                     const struct iovec *iov, int count,
+                                     size_t skip);
+static int http_connection_flush(http_connection *conn);
+static int http_connection_drain(http_connection *conn);
+
+// Whether bodies of content_type, which may carry parameters, are text that
+// compresses well rather than already compressed media
+static bool http_compressible(const char *content_type) {
+  if (content_type == NULL)
+    return false;
+  size_t len = strcspn(content_type, "; \t");
+  if (len > 5 && strncasecmp(content_type, "text/", 5) == 0)
+    return true;
+  static const char *const types[] = {"application/json",
+                                      "application/javascript",
+                                      "application/xml"};
+  for (size_t i = 0; i < sizeof types / sizeof types[0]; i++)
+    if (strlen(types[i]) == len &&
+        strncasecmp(content_type, types[i], len) == 0)
+      return true;
+  // Structured syntax suffixes, e.g. image/svg+xml or application/ld+json
+  return (len > 5 && strncasecmp(content_type + len - 5, "+json", 5) == 0) ||
+         (len > 4 && strncasecmp(content_type + len - 4, "+xml", 4) == 0);
+}
 
-  int len = strlen(response_string);
+// Whether the caller put a header called name in the response's own headers
+static bool http_response_has_header(const struct http_response *response,
+                                     const char *name) {
+  size_t name_len = strlen(name);
+  const char *line = response->headers;
+  const char *end = line + http_headers_len(response);
+  while (line != NULL && (size_t)(end - line) > name_len) {
+    if (line[name_len] == ':' && strncasecmp(line, name, name_len) == 0)
+      return true;
+    line = memchr(line, '\n', end - line);
+    if (line != NULL)
+      line++;
+  }
+  return false;
+}
 
-  int total = 0;
-  int bytesleft = len;
-  int n;
+/* Coding to send a body of len bytes (-1 when streamed) in, by the server's
+ * compression settings and the request's Accept-Encoding. Sets *vary when
+ * the response is one that gets encoded for clients that accept it, so
+ * caches keep the variants apart. Must run before the request is freed. */
+static enum compress_coding http_response_coding(struct http_response *response,
+                                                 struct http_request *request,
+                                                 long long len, bool *vary) {
+  http_connection *conn = request->_conn;
+  *vary = false;
+  if (conn == NULL)
+    return COMPRESS_NONE;
+  long min_size = conn->worker->server->compress_min_size;
+  if (min_size <= 0 || (len >= 0 && len < min_size) ||
+      response->status == 204 || response->status == 304 ||
+      !http_compressible(response->content_type) ||
+      http_response_has_header(response, "Content-Encoding"))
+    return COMPRESS_NONE;
+  *vary = true;
+  return compress_negotiate(
+      http_get_known_header(request, HTTP_HEADER_ACCEPT_ENCODING));
+}
 
-  while (total < len) {
-    n = send(request->_client_fd, response_string + total, bytesleft, 0);
-    if (n == -1)
-      break;
-    total += n;
-    bytesleft -= n;
+/* body encoded with coding, or NULL when it does not get smaller. A body
+ * sent under a cache key is looked up first, and stored once encoded; the
+ * key must be read before the request it may point into is freed. The
+ * result is malloc'd, unless *shared is set to the cache entry holding it,
+ * which is released instead. */
+static char *http_compress_response(struct http_server *server,
+                                    struct http_response *response,
+                                    enum compress_coding coding,
+                                    const char *body, size_t len,
+                                    size_t *out_len, compress_entry **shared) {
+  compress_cache *cache =
+      response->cache_key != NULL ? server->_compressed : NULL;
+  unsigned long checksum = 0;
+  *shared = NULL;
+  if (cache != NULL) {
+    checksum = compress_checksum(body, len);
+    *shared = compress_cache_get(cache, response->cache_key, coding, len,
+                                 checksum);
+    if (*shared != NULL) {
+      *out_len = (*shared)->len;
+      return (char *)(*shared)->data;
+    }
   }
-  free_http_request(request);
-  free(response_string);
-  return n == -1 ? -1 : 0;
+  char *encoded =
+      compress_body(coding, server->compress_level, body, len, out_len);
+  if (encoded != NULL && cache != NULL)
+    *shared = compress_cache_put(cache, response->cache_key, coding, len,
+                                 checksum, encoded, *out_len);
+  return encoded;
 }
 
-void http_set_response_status(struct http_response *response, int status) {
-  response->status = status;
+// Lets go of a response body, which is the caller's unless owned or shared
+static void http_body_release(char *body, bool owned,
+                              compress_entry *shared) {
+  if (shared != NULL)
+    compress_cache_release(shared);
+  else if (owned)
+    free(body);
 }
 
-void http_set_response_header(struct http_response *response, char *key,
-                              char *value) {
-  size_t new_line_len = snprintf(NULL, 0, "%s: %s\r\n", key, value);
+// A HEAD request gets the head a GET would, Content-Length and all, and
+// no body
+static bool http_head_only(const struct http_request *request) {
+  return request->request_line != NULL &&
+         request->request_line->method == HEAD;
+}
 
-  size_t old_headers_len = response->headers ? strlen(response->headers) : 0;
+/* Small bodies are copied in after the head and the response joins the
+ * output queue, so responses to pipelined requests still leave in one
+ * sendmsg. Larger ones are sent right away as head and body iovecs behind
+ * whatever is queued, and only the part the socket did not take is copied.
+ * A large body given up with free_body needs no copy and is queued as is,
+ * as is one encoded and held in the compression cache. A body that gets
+ * compressed is replaced by its encoded copy first. */
+int http_respond(struct http_response *response, struct http_request *request) {
+  if (response->body == NULL)
+    return -1;
+  bool head_only = http_head_only(request);
+  char *body = response->body;
+  bool owned = response->free_body;
+  compress_entry *shared = NULL; // a cached encoding body points into
+  size_t body_len = response->body_len > 0 ? response->body_len : strlen(body);
+  http_connection *conn = request->_conn;
+  int fd = request->_client_fd;
+  http_framing framing = {0};
+  enum compress_coding coding =
+      http_response_coding(response, request, body_len, &framing.vary);
+  if (coding != COMPRESS_NONE) {
+    size_t encoded_len;
+    char *encoded = http_compress_response(conn->worker->server, response,
+                                           coding, body, body_len,
+                                           &encoded_len, &shared);
+    if (encoded != NULL) {
+      if (owned)
+        free(body);
+      body = encoded;
+      body_len = encoded_len;
+      owned = shared == NULL;
+      framing.content_encoding = compress_coding_str[coding];
+    }
+  }
+  free_http_request(request);
 
-  char *new_headers =
-      realloc(response->headers, old_headers_len + new_line_len + 1);
-  if (new_headers == NULL) {
-    perror("realloc");
-    return;
+  framing.content_length = body_len;
+  if (head_only) {
+    http_body_release(body, owned, shared);
+    body = "";
+    body_len = 0;
+    owned = false;
+    shared = NULL;
+  }
+  bool copy_body = conn != NULL && body_len <= HTTP_COPY_BODY_MAX;
+  bool queue_body =
+      conn != NULL && (owned || shared != NULL) && !copy_body;
+  size_t head_len;
+  char *head = http_encode_head(response, conn, &framing,
+                                copy_body ? body_len : 0, &head_len);
+  http_out *body_out = queue_body ? malloc(sizeof(http_out)) : NULL;
+  if (head == NULL || (queue_body && body_out == NULL)) {
+    free(head);
+    free(body_out);
+    http_body_release(body, owned, shared);
+    return -1;
+  }
+
+  if (copy_body) {
+    memcpy(head + head_len, body, body_len);
+    http_body_release(body, owned, shared);
+    if (http_connection_queue(conn, head, head_len + body_len) == -1)
+      return -1;
+    conn->responded = true;
+    return 0;
   }
 
-  sprintf(new_headers + old_headers_len, "%s: %s\r\n", key, value);
+  if (queue_body) {
+    if (http_connection_queue(conn, head, head_len) == -1) {
+      free(body_out);
+      http_body_release(body, owned, shared);
+      return -1;
+    }
+    long threshold = conn->worker->server->zerocopy_threshold;
+    *body_out = (http_out){.data = body,
+                           .len = body_len,
+                           .encoded = shared,
+                           .zerocopy = conn->zerocopy &&
+                                       body_len >= (size_t)threshold};
+    http_out_append(conn, body_out);
+    conn->responded = true;
+    return 0;
+  }
 
-  response->headers = new_headers;
+  struct iovec iov[2] = {{.iov_base = head, .iov_len = head_len},
+                         {.iov_base = body, .iov_len = body_len}};
+  int rc = conn != NULL ? http_connection_send_iov(conn, iov, 2)
+                        : http_send_all(fd, iov, 2);
+  free(head);
+  http_body_release(body, owned, shared);
+  if (conn != NULL && rc == 0)
+    conn->responded = true;
+  return rc;
 }
 
-void http_server_listen(struct http_server server) {
-  int conn_count = 0;
-  struct pollfd *pfds = malloc(sizeof *pfds * server.concurrent_connections);
+#ifdef HTTP_WITH_URING
+// The io_uring backend has no sendfile, so it gets the file's bytes instead
+static char *http_read_file(filecache_entry *file) {
+  char *data = malloc(file->size > 0 ? file->size : 1);
+  off_t done = 0;
+  while (data != NULL && done < file->size) {
+    ssize_t n = pread(file->fd, data + done, file->size - done, done);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      free(data);
+      return NULL;
+    }
+    done += n;
+  }
+  return data;
+}
+#endif
+
+// http_respond_file, refusing a path that leads outside root unless that
+// is NULL
+static int http_respond_file_under(struct http_response *response,
+                                   struct http_request *request,
+                                   const char *path, const char *root) {
+  http_connection *conn = request->_conn;
+  if (conn == NULL)
+    return -1;
+  struct http_server *server = conn->worker->server;
+  filecache_entry *file = filecache_get(server->_files, path, root);
+  if (file == NULL)
+    return -1;
 
-  pfds[0].fd = server._socket;
-  pfds[0].events = POLLIN;
+  if (response->content_type == NULL)
+    response->content_type = file->content_type;
+
+  // Everything is allocated before the request is given up, so a failure
+  // leaves it to the caller
+  bool send_body = request->request_line->method != HEAD && file->size > 0;
+  http_framing framing = {.content_length = file->size};
+  size_t head_len;
+  char *head = http_encode_head(response, conn, &framing, 0, &head_len);
+  http_out *head_out = malloc(sizeof(http_out));
+  http_out *body_out = send_body ? malloc(sizeof(http_out)) : NULL;
+  char *data = NULL;
+#ifdef HTTP_WITH_URING
+  if (send_body && server->backend == HTTP_BACKEND_IO_URING &&
+      (data = http_read_file(file)) == NULL) {
+    free(head);
+    head = NULL;
+  }
+#endif
+  if (head == NULL || head_out == NULL || (send_body && body_out == NULL)) {
+    free(head);
+    free(head_out);
+    free(body_out);
+    filecache_release(file);
+    return -1;
+  }
 
-  conn_count = 1;
+  *head_out = (http_out){.data = head, .len = head_len};
+  http_out_append(conn, head_out);
+  if (send_body && data != NULL) {
+    *body_out = (http_out){.data = data, .len = file->size};
+    filecache_release(file);
+  } else if (send_body) {
+    *body_out = (http_out){.file = file, .len = file->size};
+  } else {
+    filecache_release(file);
+  }
+  if (send_body)
+    http_out_append(conn, body_out);
 
-  for (;;) {
-    int poll_count = poll(pfds, conn_count, -1);
+  free_http_request(request);
+  conn->responded = true;
+  return 0;
+}
 
-    if (poll_count == -1)
-      exit(1);
+int http_respond_file(struct http_response *response,
+                      struct http_request *request, const char *path) {
+  return http_respond_file_under(response, request, path, NULL);
+}
 
-    for (int i = 0; i < conn_count; i++) {
-      if (pfds[i].revents & POLLIN) {
-        if (pfds[i].fd == server._socket) {
-          struct sockaddr_storage remoteaddr;
-          socklen_t addrlen = sizeof remoteaddr;
-          int newfd =
-              accept(server._socket, (struct sockaddr *)&remoteaddr, &addrlen);
-          if (newfd != -1)
-            add_to_pfds(&pfds, newfd, &conn_count,
-                        &server.concurrent_connections);
-        } else {
-          int _client_fd = pfds[i].fd;
-          char buf[2048];
-          int nbytes = recv(_client_fd, buf, sizeof buf - 1, 0);
-
-          if (nbytes <= 0) {
-            close(_client_fd);
-            del_from_pfds(pfds, i, &conn_count);
-          } else {
-            buf[nbytes] = '\0';
-            http_request *request = calloc(1, sizeof(http_request));
-
-            if (http_parse_request(buf, request) != 0) {
-              fprintf(stderr, "Failed to parse HTTP request.\n");
-              free(request);
-            } else {
-              request->_client_fd = _client_fd;
-              server.entrypoint(request, server.context);
-            }
-
-            close(_client_fd);
-            del_from_pfds(pfds, i, &conn_count);
-          }
-        }
-      }
-    }
+// Hands over part of a streamed response. A handler thread owns its
+// connection's output queue while the request is handled, so it sends from
+// here and waits for a full socket, which keeps a slow client from piling up
+// the whole response. On the I/O loop nothing may wait on one client: the
+// piece goes out as far as the socket takes it right away, and only the
+// rest joins the output queue, which the backend sends once the handler
+// returns. A socket already known to be full is not tried. A failed send
+// aborts the stream.
+static int http_stream_send(struct http_request *request, struct iovec *iov,
+                            int count) {
+  http_connection *conn = request->_conn;
+  int rc;
+  if (conn == NULL)
+    rc = http_send_all(request->_client_fd, iov, count);
+  else if (conn->busy)
+    rc = http_connection_send_iov(conn, iov, count) == -1
+             ? -1
+             : http_connection_drain(conn);
+  else if (!conn->writing)
+    rc = http_connection_send_iov(conn, iov, count);
+  else
+    rc = http_connection_queue_iov(conn, iov, count, 0);
+  if (rc == -1) {
+    request->_aborted = true;
+    if (conn != NULL)
+      conn->keep_alive = false;
+    return -1;
   }
+  return 0;
+}
 
-  close(server._socket);
-  freeaddrinfo(&server._hints);
-  freeaddrinfo(server.res);
-  free(pfds);
+int http_respond_begin(struct http_response *response,
+                       struct http_request *request) {
+  http_connection *conn = request->_conn;
+  request->_chunked = request->request_line != NULL &&
+                      request->request_line->http_version == HTTP_1_1;
+  if (!request->_chunked && conn != NULL)
+    conn->keep_alive = false; // the close is what ends the body
+
+  http_framing framing = {.content_length = -1, .chunked = request->_chunked};
+  enum compress_coding coding =
+      http_response_coding(response, request, -1, &framing.vary);
+  // A HEAD response is framed like the GET one but has no body to encode
+  if (coding != COMPRESS_NONE &&
+      (http_head_only(request) ||
+       (request->_deflate = compress_stream_new(
+            coding, conn->worker->server->compress_level)) != NULL))
+    framing.content_encoding = compress_coding_str[coding];
+
+  size_t head_len;
+  char *head = http_encode_head(response, conn, &framing, 0, &head_len);
+  if (head == NULL) {
+    // Nothing went out, and nothing else will
+    compress_stream_free(request->_deflate);
+    request->_deflate = NULL;
+    request->_aborted = true;
+    if (conn != NULL)
+      conn->keep_alive = false;
+    return -1;
+  }
+  struct iovec iov = {.iov_base = head, .iov_len = head_len};
+  int rc = http_stream_send(request, &iov, 1);
+  free(head);
+  if (rc == 0 && conn != NULL)
+    conn->responded = true;
+  return rc;
+}
+
+// Sends one piece of a streamed body as it is to go out, framed as a chunk
+// when the body is chunked
+static int http_stream_piece(void *arg, const char *data, size_t len) {
+  struct http_request *request = arg;
+  if (!request->_chunked) {
+    struct iovec iov = {.iov_base = (char *)data, .iov_len = len};
+    return http_stream_send(request, &iov, 1);
+  }
+  char size[20];
+  struct iovec iov[3] = {
+      {.iov_base = size, .iov_len = sprintf(size, "%zx\r\n", len)},
+      {.iov_base = (char *)data, .iov_len = len},
+      {.iov_base = "\r\n", .iov_len = 2},
+  };
+  return http_stream_send(request, iov, 3);
+}
+
+// An encoded piece is flushed out of zlib on every write, which costs some
+// compression but lets the client decode each one as it arrives
+int http_respond_write(struct http_request *request, const char *data,
+                       size_t len) {
+  if (request->_aborted)
+    return -1;
+  // Nothing goes out for HEAD, and an empty chunk would end the body
+  if (len == 0 || http_head_only(request))
+    return 0;
+  if (request->_deflate != NULL)
+    return compress_stream_write(request->_deflate, data, len, false,
+                                 http_stream_piece, request);
+  return http_stream_piece(request, data, len);
+}
+
+int http_respond_end(struct http_request *request) {
+  if (request->_aborted) {
+    http_respond_abort(request);
+    return -1;
+  }
+  int rc = 0;
+  if (request->_deflate != NULL)
+    rc = compress_stream_write(request->_deflate, NULL, 0, true,
+                               http_stream_piece, request);
+  if (rc == 0 && request->_chunked && !http_head_only(request)) {
+    struct iovec iov = {.iov_base = "0\r\n\r\n", .iov_len = 5};
+    rc = http_stream_send(request, &iov, 1);
+  }
+  free_http_request(request);
+  return rc;
+}
+
+// Neither the encoder's trailer nor the last chunk goes out, so the body
+// stays visibly unfinished
+void http_respond_abort(struct http_request *request) {
+  if (request->_conn != NULL)
+    request->_conn->keep_alive = false;
+  free_http_request(request);
+}
+
+void http_set_response_status(struct http_response *response, int status) {
+  response->status = status;
+}
+
+// Appends to a buffer that at least doubles when it fills up, so adding
+// headers one by one costs time in their total length
+void http_set_response_header(struct http_response *response, char *key,
+                              char *value) {
+  size_t key_len = strlen(key), value_len = strlen(value);
+  size_t len = http_headers_len(response);
+  size_t need = len + key_len + value_len + 5; // ": ", CRLF and NUL
+  if (need > response->_headers_cap) {
+    size_t cap = response->_headers_cap > 0 ? response->_headers_cap * 2
+                                            : HTTP_HEADERS_SIZE;
+    while (cap < need)
+      cap *= 2;
+    char *headers = realloc(response->headers, cap);
+    if (headers == NULL) {
+      perror("realloc");
+      return;
+    }
+    response->headers = headers;
+    response->_headers_cap = cap;
+  }
+
+  char *p = http_put(response->headers + len, key, key_len);
+  p = HTTP_PUT_LITERAL(p, ": ");
+  p = http_put(p, value, value_len);
+  p = HTTP_PUT_LITERAL(p, "\r\n");
+  *p = '\0';
+  response->_headers_len = p - response->headers;
+}
+
+static long long http_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Sets the connection's deadline for what it now waits on. A handler
+ * thread's request is not timed. The header deadline is fixed when the
+ * request starts so trickling bytes cannot extend it, the others count
+ * from the last progress. When one passes the connection is shut down
+ * (see http_worker_sweep). */
+static void http_connection_arm(http_connection *conn) {
+  struct http_server *server = conn->worker->server;
+  enum http_timeout kind;
+  int timeout = 0;
+  if (conn->busy) {
+    kind = HTTP_TIMEOUT_NONE;
+  } else if (conn->out_head != NULL) {
+    kind = HTTP_TIMEOUT_SEND;
+    timeout = HTTP_SEND_TIMEOUT_MS;
+  } else if (conn->parser.state > HTTP_PARSE_HEADERS) {
+    kind = HTTP_TIMEOUT_BODY;
+    timeout = server->body_timeout_ms;
+  } else if (conn->len > conn->start || conn->served == 0) {
+    kind = HTTP_TIMEOUT_HEADER;
+    timeout = server->header_timeout_ms;
+  } else if (conn->worker->draining) {
+    // No further request would be served, the loop closes it on the hangup
+    kind = HTTP_TIMEOUT_NONE;
+    shutdown(conn->fd, SHUT_RDWR);
+  } else {
+    kind = HTTP_TIMEOUT_IDLE;
+    timeout = server->keepalive_timeout_ms;
+  }
+  if (kind == HTTP_TIMEOUT_HEADER && conn->timeout == HTTP_TIMEOUT_HEADER)
+    return;
+  conn->timeout = kind;
+  if (timeout > 0)
+    timerwheel_schedule(conn->worker->timers, &conn->timer,
+                        http_now_ms() + timeout);
+  else
+    timerwheel_cancel(conn->worker->timers, &conn->timer);
+}
+
+// Links a freshly accepted connection into its worker's list
+static void http_connection_attach(http_worker *worker,
+                                   http_connection *conn) {
+  conn->worker = worker;
+  conn->last_active = http_now_ms();
+  conn->next = worker->conns;
+  if (worker->conns != NULL)
+    worker->conns->prev = conn;
+  worker->conns = conn;
+  http_connection_arm(conn);
+}
+
+// Wraps an accepted socket, closing it on failure
+static http_connection *http_connection_new(http_worker *worker, int fd) {
+  http_connection *conn = calloc(1, sizeof(http_connection));
+  char *buf = malloc(HTTP_READ_BUF_SIZE + 1);
+  arena *requests = arena_create(HTTP_ARENA_SIZE);
+  if (conn == NULL || buf == NULL || requests == NULL) {
+    free(conn);
+    free(buf);
+    arena_destroy(requests);
+    close(fd);
+    return NULL;
+  }
+  conn->fd = fd;
+  conn->buf = buf;
+  conn->arena = requests;
+  conn->cap = HTTP_READ_BUF_SIZE;
+  http_connection_attach(worker, conn);
+  return conn;
+}
+
+// Makes room for at least one more byte in conn->buf by doubling it. Fails
+// once the buffer would outgrow what the largest allowed request needs.
+static int http_connection_grow(http_connection *conn) {
+  struct http_server *server = conn->worker->server;
+  long limit =
+      server->max_header_size + server->max_body_size + HTTP_READ_BUF_SIZE;
+  if (conn->cap >= limit)
+    return -1;
+  int cap = conn->cap * 2 < limit ? conn->cap * 2 : (int)limit;
+  char *buf = realloc(conn->buf, cap + 1);
+  if (buf == NULL)
+    return -1;
+  conn->buf = buf;
+  conn->cap = cap;
+  if (conn->stream != NULL)
+    http_parser_rebind(&conn->parser, buf + conn->start, conn->stream);
+  return 0;
+}
+
+// Whether the body of the request being parsed goes to body_handler rather
+// than being buffered
+static bool http_connection_streaming(http_connection *conn) {
+  http_parser *p = &conn->parser;
+  return conn->worker->server->body_handler != NULL &&
+         p->state > HTTP_PARSE_HEADERS && p->state != HTTP_PARSE_ERROR &&
+         (p->chunked || p->content_length > 0);
+}
+
+// Accepts one pending connection, returning NULL once the backlog is empty
+// (or accept fails for want of descriptors). Connections that cannot be set
+// up are dropped and the next one is tried, so a caller draining the backlog
+// does not stop early.
+static http_connection *http_accept(http_worker *worker) {
+  http_connection *conn = NULL;
+  while (conn == NULL) {
+#ifdef SOCK_NONBLOCK
+    int newfd = accept4(worker->socket, NULL, NULL,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int newfd = accept(worker->socket, NULL, NULL);
+    if (newfd != -1 && set_nonblocking(newfd) == -1) {
+      close(newfd);
+      continue;
+    }
+#endif
+    if (newfd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return NULL;
+    }
+    conn = http_connection_new(worker, newfd);
+  }
+#ifdef SO_ZEROCOPY
+  int yes = 1;
+  if (worker->server->zerocopy_threshold > 0)
+    conn->zerocopy = setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &yes,
+                                sizeof yes) == 0;
+#endif
+  return conn;
+}
+
+// Runs first on every handler thread to set up its context
+static void http_pool_thread_init(int id, void *arg) {
+  http_pool *pool = arg;
+  struct http_server *server = pool->server;
+  void **context = server->context;
+  if (server->worker_context != NULL)
+    context = server->worker_context(server->_worker_count + id, context);
+  pool->contexts[id] = context;
+}
+
+static http_pool *http_pool_create(struct http_server *server, int threads,
+                                   int capacity) {
+  http_pool *pool = calloc(1, sizeof(http_pool));
+  if (pool == NULL)
+    return NULL;
+  pool->contexts = calloc(threads, sizeof(void **));
+  if (pool->contexts == NULL) {
+    free(pool);
+    return NULL;
+  }
+  pool->capacity = capacity;
+  pool->threads = threads;
+  pool->server = server;
+  atomic_init(&pool->in_flight, 0);
+
+  pool->sched = scheduler_create(threads, http_pool_thread_init, pool);
+  if (pool->sched == NULL) {
+    free(pool->contexts);
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+// Joins the handler threads and releases their contexts. Only once no
+// request is in flight, as when every worker's loop returned.
+static void http_pool_destroy(http_pool *pool) {
+  struct http_server *server = pool->server;
+  scheduler_destroy(pool->sched);
+  for (int i = 0; i < pool->threads; i++)
+    if (server->worker_context_free != NULL && pool->contexts[i] != NULL &&
+        pool->contexts[i] != server->context)
+      server->worker_context_free(server->_worker_count + i,
+                                  pool->contexts[i]);
+  free(pool->contexts);
+  free(pool);
+}
+
+static void http_worker_complete(http_worker *worker, http_connection *conn);
+
+static void http_pool_run(void *arg) {
+  http_job *job = arg;
+  http_pool *pool = job->pool;
+  http_connection *conn = job->conn;
+
+  pool->server->entrypoint(job->request,
+                           pool->contexts[scheduler_current_id()]);
+  free(job);
+  atomic_fetch_sub(&pool->in_flight, 1);
+  http_worker_complete(conn->worker, conn);
+}
+
+// Queues a request for the handler threads, -1 when too many are in flight
+static int http_pool_submit(http_pool *pool, http_request *request,
+                            http_connection *conn) {
+  if (atomic_fetch_add(&pool->in_flight, 1) >= pool->capacity) {
+    atomic_fetch_sub(&pool->in_flight, 1);
+    return -1;
+  }
+  http_job *job = malloc(sizeof(http_job));
+  if (job == NULL) {
+    atomic_fetch_sub(&pool->in_flight, 1);
+    return -1;
+  }
+  *job = (http_job){.request = request, .conn = conn, .pool = pool};
+  conn->busy = true;
+  if (scheduler_submit(pool->sched, http_pool_run, job) == -1) {
+    conn->busy = false;
+    free(job);
+    atomic_fetch_sub(&pool->in_flight, 1);
+    return -1;
+  }
+  return 0;
+}
+
+scheduler *http_handler_scheduler(void) { return scheduler_self(); }
+
+// Hands a finished connection back to the worker that owns its socket
+static void http_worker_complete(http_worker *worker, http_connection *conn) {
+  pthread_mutex_lock(&worker->done_lock);
+  conn->next_done = worker->done;
+  worker->done = conn;
+  pthread_mutex_unlock(&worker->done_lock);
+
+  char byte = 0;
+  while (write(worker->wake[1], &byte, 1) == -1 && errno == EINTR)
+    ;
+}
+
+// Drains the wake pipe and returns the connections handlers finished with
+static http_connection *http_worker_take_done(http_worker *worker) {
+  char drain[64];
+  while (read(worker->wake[0], drain, sizeof drain) > 0)
+    ;
+  pthread_mutex_lock(&worker->done_lock);
+  http_connection *done = worker->done;
+  worker->done = NULL;
+  pthread_mutex_unlock(&worker->done_lock);
+  return done;
+}
+
+
+// Whether a comma-separated header value lists token, ignoring case
+static bool http_has_token(const char *value, const char *token) {
+  size_t len = strlen(token);
+  while (value != NULL && *value != '\0') {
+    while (*value == ' ' || *value == '\t' || *value == ',')
+      value++;
+    if (strncasecmp(value, token, len) == 0) {
+      const char *end = value + len;
+      while (*end == ' ' || *end == '\t')
+        end++;
+      if (*end == '\0' || *end == ',')
+        return true;
+    }
+    value = strchr(value, ',');
+  }
+  return false;
+}
+
+// HTTP/1.1 connections persist unless the client sends Connection: close,
+// HTTP/1.0 ones only when it asks for keep-alive
+static bool http_wants_keep_alive(http_request *request) {
+  const char *connection =
+      http_get_known_header(request, HTTP_HEADER_CONNECTION);
+  if (request->request_line->http_version == HTTP_1_1)
+    return !http_has_token(connection, "close");
+  if (request->request_line->http_version == HTTP_1_0)
+    return http_has_token(connection, "keep-alive");
+  return false;
+}
+
+// Runs the entrypoint inline or hands the request to the handler pool.
+// Returns false when the request went to a handler thread.
+static bool http_dispatch(http_worker *worker, http_connection *conn,
+                          http_request *request) {
+  http_pool *pool = worker->server->_pool;
+  if (pool == NULL) {
+    worker->server->entrypoint(request, worker->context);
+    return true;
+  }
+  if (http_pool_submit(pool, request, conn) == -1) {
+    http_response busy = {.body = "Service Unavailable"};
+    http_set_response_status(&busy, HTTP_SERVICE_UNAVAILABLE);
+    busy.content_type = CONTENT_TYPE_TEXT;
+    http_respond(&busy, request);
+    return true;
+  }
+  return false;
+}
+
+// Bookkeeping once the entrypoint is done with the request at conn->start
+static void http_request_done(http_connection *conn) {
+  conn->buf[conn->req_end] = conn->req_saved;
+  conn->start = conn->req_end;
+  conn->served++;
+  conn->timeout = HTTP_TIMEOUT_NONE; // the next one gets its own deadline
+  http_parser_reset(&conn->parser);
+  // Without a response the client would wait forever for this request's
+  // slot in the pipeline
+  if (!conn->keep_alive || !conn->responded)
+    conn->closing = true;
+}
+
+/* A connection serves one request at a time, so each is built in the
+ * connection's arena, which free_http_request resets once it is answered:
+ * the request, its request line and its headers cost no malloc or free. */
+static http_request *http_connection_request(http_connection *conn) {
+  http_request *request = arena_alloc(conn->arena, sizeof(http_request));
+  if (request != NULL)
+    *request = (http_request){
+        ._client_fd = conn->fd, ._conn = conn, ._arena = conn->arena};
+  return request;
+}
+
+// Answers a request the parser refused and ends the connection, since
+// what follows it in the stream cannot be trusted to start a new request
+static void http_connection_refuse(http_connection *conn, int status) {
+  // Off the arena, which may still hold the request being streamed
+  http_request *request = calloc(1, sizeof(http_request));
+  if (request != NULL) {
+    request->_client_fd = conn->fd;
+    request->_conn = conn;
+    conn->keep_alive = false;
+    http_response response = {.body = ""};
+    http_set_response_status(&response, status);
+    http_respond(&response, request);
+    free(response.headers);
+  }
+  conn->closing = true;
+}
+
+// Hands the body bytes decoded so far to body_handler and drops them from
+// buf, then signals the end of the body once the request is complete.
+// Returns the status to refuse the request with, or 0.
+static int http_connection_stream(http_worker *worker, http_connection *conn) {
+  http_parser *p = &conn->parser;
+  char *begin = conn->buf + conn->start;
+  int (*handler)(http_request *, const char *, size_t, void **) =
+      worker->server->body_handler;
+
+  if (conn->stream == NULL) {
+    http_request *request = http_connection_request(conn);
+    if (request == NULL || http_parser_build(p, begin, request, false) != 0) {
+      free_http_request(request);
+      return HTTP_SERVICE_UNAVAILABLE;
+    }
+    conn->stream = request;
+  }
+
+  if (p->body_len > 0 && handler(conn->stream, begin + p->body_off,
+                                 p->body_len, worker->context) != 0)
+    return HTTP_BAD_REQUEST;
+  conn->len -= http_parser_reclaim(p, begin, conn->len - conn->start, true);
+  if (p->state != HTTP_PARSE_DONE)
+    return 0;
+  p->body_len = 0;
+  if (handler(conn->stream, begin + p->body_off, 0, worker->context) != 0)
+    return HTTP_BAD_REQUEST;
+  return 0;
+}
+
+// Tells a client waiting on Expect: 100-continue to send the body
+static void http_connection_continue(http_connection *conn) {
+  static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+  conn->parser.expect_continue = false;
+  if (conn->parser.version != HTTP_1_1)
+    return;
+  char *data = malloc(sizeof interim - 1);
+  if (data == NULL)
+    return;
+  memcpy(data, interim, sizeof interim - 1);
+  http_connection_queue(conn, data, sizeof interim - 1);
+}
+
+// Whether a request path, up to len, climbs out of the directory it is in
+static bool http_path_escapes(const char *path, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    size_t seg = i;
+    while (i < len && path[i] != '/')
+      i++;
+    if (i - seg == 2 && path[seg] == '.' && path[seg + 1] == '.')
+      return true;
+    i++;
+  }
+  return false;
+}
+
+// Percent-decodes len bytes of a request path into dst and NUL-terminates
+// it ('+' is a plain character in paths). Returns the decoded length, or -1
+// when that does not fit in size bytes or it would hold a NUL.
+static long http_path_decode(const char *src, size_t len, char *dst,
+                             size_t size) {
+  size_t out = 0;
+  for (size_t i = 0; i < len; out++) {
+    if (out + 1 >= size)
+      return -1;
+    unsigned char c = src[i++];
+    if (c == '%' && i + 2 <= len && http_hex_digit(src[i]) != -1 &&
+        http_hex_digit(src[i + 1]) != -1) {
+      c = http_hex_digit(src[i]) << 4 | http_hex_digit(src[i + 1]);
+      i += 2;
+    }
+    if (c == '\0')
+      return -1;
+    dst[out] = c;
+  }
+  dst[out] = '\0';
+  return out;
+}
+
+// Answers a GET or HEAD under static_prefix from static_root. Returns false,
+// leaving the request alone, when it is not one.
+static bool http_serve_static(struct http_server *server,
+                              http_request *request) {
+  enum http_method method = request->request_line->method;
+  const char *uri = request->request_line->request_uri;
+  size_t prefix_len = strlen(server->static_prefix);
+  if ((method != GET && method != HEAD) ||
+      strncmp(uri, server->static_prefix, prefix_len) != 0)
+    return false;
+  const char *rel = uri + prefix_len;
+  if (prefix_len > 0 && server->static_prefix[prefix_len - 1] != '/' &&
+      *rel != '/' && *rel != '\0' && *rel != '?')
+    return false; // /static must not match /staticky
+
+  // Checked for ".." once decoded, or "%2e%2e" would get through
+  char name[PATH_MAX];
+  long name_len = http_path_decode(rel, strcspn(rel, "?#"), name, sizeof name);
+  const char *file = name;
+  while (name_len > 0 && *file == '/')
+    file++, name_len--;
+  bool dir = name_len <= 0 || file[name_len - 1] == '/';
+  char path[PATH_MAX];
+  int len = name_len < 0 ? -1
+                         : snprintf(path, sizeof path, "%s/%s%s",
+                                    server->static_root, file,
+                                    dir ? "index.html" : "");
+
+  http_response response = {.status = HTTP_OK};
+  if (len < 0 || len >= (int)sizeof path ||
+      http_path_escapes(file, name_len) ||
+      // Nor may a symlink lead out of static_root
+      http_respond_file_under(&response, request, path,
+                              server->static_root) != 0) {
+    http_response missing = {.body = "Not Found"};
+    http_set_response_status(&missing, HTTP_NOT_FOUND);
+    missing.content_type = CONTENT_TYPE_TEXT;
+    http_respond(&missing, request);
+  }
+  free(response.headers);
+  return true;
+}
+
+/* Serves every complete request buffered on the connection, in order, each
+ * response joining the output queue. Stops when a request goes to a handler
+ * thread (busy), the connection is closing, or only a partial request is
+ * left, which is moved to the front of buf. */
+static void http_connection_process(http_worker *worker,
+                                    http_connection *conn) {
+  struct http_server *server = worker->server;
+  // Streamed bodies are never held whole, so they need no bound
+  http_parser_limits limits = {.max_header_size = server->max_header_size,
+                               .max_body_size = server->body_handler != NULL
+                                                    ? LONG_MAX
+                                                    : server->max_body_size};
+
+  while (!conn->busy && !conn->closing && !conn->writing) {
+    char *begin = conn->buf + conn->start;
+    enum http_parse_state state = http_parser_execute(
+        &conn->parser, begin, conn->len - conn->start, &limits);
+    if (state == HTTP_PARSE_ERROR) {
+      http_connection_refuse(conn, conn->parser.status);
+      break;
+    }
+    if (state > HTTP_PARSE_HEADERS && state < HTTP_PARSE_DONE &&
+        conn->parser.expect_continue)
+      http_connection_continue(conn);
+    if (http_connection_streaming(conn)) {
+      int status = http_connection_stream(worker, conn);
+      if (status != 0) {
+        http_connection_refuse(conn, status);
+        break;
+      }
+    } else {
+      // Chunk framing is not part of the body, give its room back
+      conn->len -= http_parser_reclaim(&conn->parser, begin,
+                                       conn->len - conn->start, false);
+    }
+    if (state != HTTP_PARSE_DONE)
+      break;
+
+    // Terminate the request in place so the handler stops at its end; the
+    // clobbered first byte of the next one is put back after
+    int end = conn->start + conn->parser.end;
+    conn->req_end = end;
+    conn->req_saved = conn->buf[end];
+    conn->buf[end] = '\0';
+    conn->responded = false;
+
+    http_request *request = conn->stream;
+    conn->stream = NULL;
+    if (request == NULL) {
+      request = http_connection_request(conn);
+      if (request == NULL ||
+          http_parser_build(&conn->parser, begin, request, true) != 0) {
+        free_http_request(request);
+        conn->buf[end] = conn->req_saved;
+        http_connection_refuse(conn, HTTP_SERVICE_UNAVAILABLE);
+        break;
+      }
+    }
+
+    request->_client_fd = conn->fd;
+    request->_conn = conn;
+    conn->keep_alive =
+        server->keepalive_timeout_ms > 0 && !worker->draining &&
+        (server->keepalive_max_requests <= 0 ||
+         conn->served + 1 < server->keepalive_max_requests) &&
+        http_wants_keep_alive(request);
+
+    if (server->static_prefix != NULL && http_serve_static(server, request)) {
+      http_request_done(conn);
+      continue;
+    }
+    if (!http_dispatch(worker, conn, request))
+      break; // http_connection_resume picks up from here
+    http_request_done(conn);
+  }
+
+  if (!conn->busy && conn->start > 0) {
+    memmove(conn->buf, conn->buf + conn->start, conn->len - conn->start);
+    conn->len -= conn->start;
+    conn->start = 0;
+    if (conn->stream != NULL)
+      http_parser_rebind(&conn->parser, conn->buf, conn->stream);
+  }
+  // Let go of a buffer grown for one large request
+  if (!conn->busy && conn->len == 0 && conn->cap > HTTP_READ_BUF_SIZE) {
+    char *buf = realloc(conn->buf, HTTP_READ_BUF_SIZE + 1);
+    if (buf != NULL) {
+      conn->buf = buf;
+      conn->cap = HTTP_READ_BUF_SIZE;
+    }
+  }
+}
+
+// Fills iov from the output queue up to the first file or zero-copy body,
+// returns the number of entries used
+static int http_out_iov(http_connection *conn, struct iovec *iov, int max) {
+  int n = 0;
+  size_t skip = conn->out_sent;
+  for (http_out *out = conn->out_head;
+       out != NULL && out->file == NULL && !out->zerocopy && n < max;
+       out = out->next) {
+    iov[n].iov_base = out->data + skip;
+    iov[n].iov_len = out->len - skip;
+    skip = 0;
+    n++;
+  }
+  return n;
+}
+
+static void http_out_free(http_out *out) {
+  if (out->encoded != NULL)
+    compress_cache_release(out->encoded);
+  else
+    free(out->data);
+  if (out->file != NULL)
+    filecache_release(out->file);
+  free(out);
+}
+
+// Drops written bytes from the front of the output queue. Buffers the kernel
+// may still be reading from wait for their zero-copy completion instead.
+static void http_out_consume(http_connection *conn, size_t written) {
+  while (conn->out_head != NULL &&
+         written >= conn->out_head->len - conn->out_sent) {
+    http_out *out = conn->out_head;
+    written -= out->len - conn->out_sent;
+    conn->out_sent = 0;
+    conn->out_head = out->next;
+    if (!out->zc_used) {
+      http_out_free(out);
+      continue;
+    }
+    out->next = NULL;
+    if (conn->zc_tail != NULL)
+      conn->zc_tail->next = out;
+    else
+      conn->zc_head = out;
+    conn->zc_tail = out;
+  }
+  if (conn->out_head == NULL)
+    conn->out_tail = NULL;
+  else
+    conn->out_sent += written;
+}
+
+/* Sends iov behind whatever is queued with one sendmsg, without waiting for
+ * the socket, and queues a copy of what it did not take. When the queue is
+ * too long to go out in the same call all of iov is copied instead. */
+static int http_connection_send_iov(http_connection *conn,
+                                    const struct iovec *iov, int count) {
+  struct iovec all[HTTP_IOV_BATCH];
+  int queued = http_out_iov(conn, all, HTTP_IOV_BATCH - count);
+  size_t queued_len = 0;
+  http_out *rest = conn->out_head;
+  for (int i = 0; i < queued; i++) {
+    queued_len += all[i].iov_len;
+    rest = rest->next;
+  }
+
+  size_t sent = 0;
+  if (rest == NULL) {
+    memcpy(all + queued, iov, count * sizeof *iov);
+    struct msghdr msg = {.msg_iov = all, .msg_iovlen = queued + count};
+    ssize_t n;
+    while ((n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+      ;
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    sent = n > 0 ? n : 0;
+  }
+  http_out_consume(conn, sent < queued_len ? sent : queued_len);
+  sent = sent > queued_len ? sent - queued_len : 0;
+
+  return http_connection_queue_iov(conn, iov, count, sent);
+}
+
+// Queues a copy of iov in one buffer, leaving out its first skip bytes
+static int http_connection_queue_iov(http_connection *conn,
+                                     const struct iovec *iov, int count,
+                                     size_t skip) {
+  size_t left = 0;
+  for (int i = 0; i < count; i++)
+    left += iov[i].iov_len;
+  if (skip >= left)
+    return 0;
+  char *copy = malloc(left - skip);
+  if (copy == NULL)
+    return -1;
+  size_t off = 0;
+  for (int i = 0; i < count; i++) {
+    size_t from = skip < iov[i].iov_len ? skip : iov[i].iov_len;
+    skip -= from;
+    memcpy(copy + off, (char *)iov[i].iov_base + from, iov[i].iov_len - from);
+    off += iov[i].iov_len - from;
+  }
+  return http_connection_queue(conn, copy, off);
+}
+
+/* Reads zero-copy completions off the socket's error queue and frees the
+ * buffers they release. Each reports a range of send ids, and since TCP
+ * completes sends in order everything below the end of the range is done.
+ * A completion marked COPIED means the kernel had to copy after all (e.g.
+ * over loopback), and the connection stops paying for pinning pages. */
+static void http_connection_reap(http_connection *conn) {
+  if (conn->zc_head == NULL)
+    return;
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 8];
+  for (;;) {
+    struct msghdr msg = {.msg_control = control,
+                         .msg_controllen = sizeof control};
+    if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) == -1) {
+      if (errno == EINTR)
+        continue;
+      break; // EAGAIN once the queue is empty
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        continue;
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof err);
+      if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        conn->zerocopy = false;
+      if ((int32_t)(err.ee_data + 1 - conn->zc_done) > 0)
+        conn->zc_done = err.ee_data + 1;
+    }
+  }
+#endif
+  while (conn->zc_head != NULL &&
+         (int32_t)(conn->zc_head->zc_id - conn->zc_done) < 0) {
+    http_out *out = conn->zc_head;
+    conn->zc_head = out->next;
+    http_out_free(out);
+  }
+  if (conn->zc_head == NULL)
+    conn->zc_tail = NULL;
+}
+
+// Sends what is left of a zero-copy body. The kernel numbers every send
+// that took some of it, so the entry remembers the last one.
+static ssize_t http_connection_send_zerocopy(http_connection *conn,
+                                             http_out *out) {
+  struct iovec iov = {.iov_base = out->data + conn->out_sent,
+                      .iov_len = out->len - conn->out_sent};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+  if (n == -1 && errno == ENOBUFS) // out of pinned page budget, copy it
+    return sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+  if (n > 0) {
+    out->zc_used = true;
+    out->zc_id = conn->zc_next++;
+  }
+  return n;
+}
+
+// Writes as much of the output queue as the socket takes, one sendmsg per
+// HTTP_IOV_BATCH responses and one sendfile per file. Returns 0 once the
+// queue is empty, 1 when the socket is full and -1 when the connection failed.
+static int http_connection_flush(http_connection *conn) {
+  while (conn->out_head != NULL) {
+    http_out *out = conn->out_head;
+    ssize_t n;
+    if (out->file != NULL) {
+      off_t offset = out->offset + conn->out_sent;
+      n = sendfile(conn->fd, out->file->fd, &offset, out->len - conn->out_sent);
+      if (n == 0)
+        return -1; // the file shrank since it was stat'ed
+    } else if (out->zerocopy) {
+      n = http_connection_send_zerocopy(conn, out);
+    } else {
+      struct iovec iov[HTTP_IOV_BATCH];
+      struct msghdr msg = {.msg_iov = iov};
+      msg.msg_iovlen = http_out_iov(conn, iov, HTTP_IOV_BATCH);
+      // Hold back a partial packet when a body sent separately comes right
+      // after
+      for (size_t i = 0; i < msg.msg_iovlen; i++)
+        out = out->next;
+      bool more = out != NULL && (out->file != NULL || out->zerocopy);
+      n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    }
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      return -1;
+    }
+    http_out_consume(conn, n);
+    conn->last_active = http_now_ms();
+  }
+  return 0;
+}
+
+// Flushes the whole output queue, waiting for the socket as needed. Only for
+// handler threads, which are allowed to block.
+static int http_connection_drain(http_connection *conn) {
+  int rc;
+  while ((rc = http_connection_flush(conn)) == 1) {
+    http_connection_reap(conn); // or POLLERR would keep waking the poll
+    struct pollfd pfd = {.fd = conn->fd, .events = POLLOUT};
+    int ready = poll(&pfd, 1, HTTP_SEND_TIMEOUT_MS);
+    if (ready == 0 || (ready == -1 && errno != EINTR))
+      return -1;
+  }
+  return rc;
+}
+
+static void http_connection_close(http_connection *conn) {
+  http_worker *worker = conn->worker;
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else
+    worker->conns = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+  timerwheel_cancel(worker->timers, &conn->timer);
+  if (conn->stream != NULL) {
+    // The body will never be finished
+    worker->server->body_handler(conn->stream, NULL, 0, worker->context);
+    free_http_request(conn->stream);
+  }
+  http_out_consume(conn, (size_t)-1);
+  http_parser_free(&conn->parser);
+  free(conn->buf);
+  conn->buf = NULL;
+  arena_destroy(conn->arena);
+  conn->arena = NULL;
+  http_connection_reap(conn);
+  if (conn->zc_head != NULL) {
+    // Shut down, the socket still reports completions and sends the rest
+    shutdown(conn->fd, SHUT_RDWR);
+    conn->lingering = true;
+    conn->last_active = http_now_ms();
+    conn->prev = NULL;
+    conn->next = worker->lingering;
+    worker->lingering = conn;
+    return;
+  }
+  if (conn->fd != -1)
+    close(conn->fd);
+  free(conn);
+}
+
+// Serves buffered requests and flushes their responses. Returns true when
+// the connection was closed.
+static bool http_connection_serve(http_worker *worker, http_connection *conn) {
+  http_connection_process(worker, conn);
+  // A busy connection's output queue belongs to the handler thread
+  if (!conn->busy) {
+    http_connection_reap(conn);
+    int rc = http_connection_flush(conn);
+    conn->writing = rc == 1;
+    if (rc == -1 || (conn->closing && !conn->writing)) {
+      http_connection_close(conn);
+      return true;
+    }
+  }
+  http_connection_arm(conn);
+  return false;
+}
+
+// Called on the owning worker once a handler thread finished a request
+static void http_connection_resume(http_connection *conn) {
+  conn->busy = false;
+  http_request_done(conn);
+  conn->last_active = http_now_ms();
+}
+
+// Drains the socket and serves whatever complete requests it holds. Returns
+// true when the connection was closed.
+static bool http_connection_read(http_worker *worker,
+                                 http_connection *conn) {
+  bool stuck = false; // serving last time freed no room
+  for (;;) {
+    bool full = false;
+    for (;;) {
+      // A busy connection keeps its requests in place for the handler, the
+      // rest of the pipeline waits in the socket. A streamed body is handed
+      // off to make room before the buffer is grown.
+      if (conn->len == conn->cap &&
+          (conn->busy || conn->writing ||
+           (!stuck && http_connection_streaming(conn)) ||
+           http_connection_grow(conn) == -1)) {
+        full = true;
+        break;
+      }
+      int room = conn->cap - conn->len;
+      int nbytes = recv(conn->fd, conn->buf + conn->len, room, 0);
+      if (nbytes == 0) {
+        http_connection_close(conn);
+        return true;
+      }
+      if (nbytes == -1) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        http_connection_close(conn);
+        return true;
+      }
+      conn->len += nbytes;
+      conn->last_active = http_now_ms();
+    }
+    if (http_connection_serve(worker, conn))
+      return true;
+    stuck = conn->len == conn->cap;
+    // Only a full buffer leaves unread bytes in the socket
+    if (!full || conn->busy || conn->writing)
+      return false;
+  }
+}
+
+// Continues flushing once the socket takes more, then goes back to serving
+// the requests that waited. Returns true when the connection was closed.
+static bool http_connection_write(http_worker *worker,
+                                  http_connection *conn) {
+  http_connection_reap(conn);
+  int rc = http_connection_flush(conn);
+  if (rc == 1) {
+    http_connection_arm(conn);
+    return false;
+  }
+  conn->writing = false;
+  if (rc == -1 || conn->closing) {
+    http_connection_close(conn);
+    return true;
+  }
+  // Reading was held off while writing, epoll raises no new edge for it
+  return http_connection_read(worker, conn);
+}
+
+// Readiness a connection waits for in the poll backend
+static short http_poll_events(http_connection *conn) {
+  return conn->writing ? POLLOUT : POLLIN;
+}
+
+// Frees lingering connections once their zero-copy sends completed. Those
+// the kernel holds on to for too long are reset, which drops the unsent data
+// and with it the kernel's references to the buffers.
+static void http_worker_linger(http_worker *worker, long long now) {
+  http_connection **link = &worker->lingering;
+  while (*link != NULL) {
+    http_connection *conn = *link;
+    http_connection_reap(conn);
+    if (conn->zc_head != NULL) {
+      if (now - conn->last_active < HTTP_ZEROCOPY_LINGER_MS) {
+        link = &conn->next;
+        continue;
+      }
+      struct linger reset = {.l_onoff = 1, .l_linger = 0};
+      setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+    }
+    *link = conn->next;
+    close(conn->fd);
+    while (conn->zc_head != NULL) {
+      http_out *out = conn->zc_head;
+      conn->zc_head = out->next;
+      http_out_free(out);
+    }
+    free(conn);
+  }
+}
+
+// Shuts down connections whose deadline passed. The loop then sees them
+// hang up and closes them like any other.
+static void http_worker_sweep(http_worker *worker) {
+  long long now = http_now_ms();
+  timerwheel_timer *timer;
+  while ((timer = timerwheel_expire(worker->timers, now)) != NULL) {
+    http_connection *conn =
+        (http_connection *)((char *)timer - offsetof(http_connection, timer));
+    conn->timeout = HTTP_TIMEOUT_NONE;
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+  if (worker->lingering != NULL &&
+      now - worker->last_sweep >= HTTP_SWEEP_INTERVAL_MS) {
+    worker->last_sweep = now;
+    http_worker_linger(worker, now);
+  }
+}
+
+/* State of a server that can hand its listening sockets to its successor,
+ * see http_server_options.handoff_path. A thread of its own waits for the
+ * new process on the Unix socket; once that has the sockets it tells the
+ * workers through their wake pipes. */
+typedef struct http_handoff {
+  struct http_server *server;
+  int fd;
+  pthread_t thread;
+  atomic_bool done;
+} http_handoff;
+
+// Sends the listening sockets to the process connected on fd. Returns true
+// once it confirmed having them.
+static bool http_handoff_send(struct http_server *server, int fd) {
+  struct ucred peer;
+  socklen_t peer_len = sizeof peer;
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1 ||
+      peer.uid != geteuid())
+    return false;
+  int count = server->_listener_count;
+  if (count > HTTP_HANDOFF_MAX) {
+    fprintf(stderr, "handoff: too many listening sockets\n");
+    return false;
+  }
+
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HTTP_HANDOFF_MAX)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {.iov_base = &count, .iov_len = sizeof count};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = CMSG_SPACE(sizeof(int) * count)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  for (int i = 0; i < count; i++)
+    memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &server->_workers[i].socket,
+           sizeof(int));
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof count)
+    return false;
+
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  char ack;
+  return poll(&pfd, 1, HTTP_HANDOFF_TIMEOUT_MS) == 1 && read(fd, &ack, 1) == 1;
+}
+
+static void *http_handoff_run(void *arg) {
+  http_handoff *handoff = arg;
+  struct http_server *server = handoff->server;
+  for (;;) {
+    int fd = accept4(handoff->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("handoff accept");
+      return NULL;
+    }
+    bool sent = http_handoff_send(server, fd);
+    close(fd);
+    if (sent)
+      break;
+  }
+  close(handoff->fd);
+
+  atomic_store(&handoff->done, true);
+  char byte = 0;
+  for (int i = 0; i < server->_worker_count; i++)
+    while (write(server->_workers[i].wake[1], &byte, 1) == -1 &&
+           errno == EINTR)
+      ;
+  return NULL;
+}
+
+// Listens at the server's handoff path for a successor, exits on failure
+static http_handoff *http_handoff_start(struct http_server *server) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(server->handoff_path) >= sizeof addr.sun_path) {
+    fprintf(stderr, "error: handoff path too long\n");
+    exit(1);
+  }
+  strcpy(addr.sun_path, server->handoff_path);
+
+  http_handoff *handoff = calloc(1, sizeof(http_handoff));
+  if (handoff == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  handoff->server = server;
+  handoff->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (handoff->fd == -1) {
+    perror("handoff socket");
+    exit(1);
+  }
+  // Whatever is there belongs to the server this one took over from
+  unlink(addr.sun_path);
+  if (bind(handoff->fd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+      listen(handoff->fd, 1) == -1) {
+    perror("handoff bind");
+    exit(1);
+  }
+  if (pthread_create(&handoff->thread, NULL, http_handoff_run, handoff) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+  return handoff;
+}
+
+// Checked on wakeups. The first time after the listening sockets were handed
+// off it returns true, for the loop to stop accepting; connections between
+// requests are closed and the rest are told to be their last.
+static bool http_worker_handed_off(http_worker *worker) {
+  http_handoff *handoff = worker->server->_handoff;
+  if (worker->draining || handoff == NULL || !atomic_load(&handoff->done))
+    return false;
+  worker->draining = true;
+  for (http_connection *conn = worker->conns; conn != NULL; conn = conn->next)
+    if (!conn->busy)
+      http_connection_arm(conn);
+  return true;
+}
+
+// Whether a worker that handed off its listening socket is done
+static bool http_worker_drained(http_worker *worker) {
+  return worker->draining && worker->conns == NULL &&
+         worker->lingering == NULL;
+}
+
+// Milliseconds until the next deadline, -1 when there is none
+static int http_loop_timeout(http_worker *worker) {
+  int timeout = timerwheel_timeout(worker->timers, http_now_ms());
+  if (worker->lingering != NULL &&
+      (timeout == -1 || timeout > HTTP_SWEEP_INTERVAL_MS))
+    timeout = HTTP_SWEEP_INTERVAL_MS;
+  return timeout;
+}
+
+static void http_listen_poll(http_worker *worker) {
+  int conn_count = 0;
+  int fd_size = worker->server->concurrent_connections;
+  struct pollfd *pfds = malloc(sizeof *pfds * fd_size);
+  http_connection **conns = malloc(sizeof *conns * fd_size);
+
+  pfds[0].fd = worker->socket;
+  pfds[0].events = POLLIN;
+  conns[0] = NULL;
+
+  conn_count = 1;
+  add_to_pfds(&pfds, &conns, worker->wake[0], NULL, &conn_count, &fd_size);
+
+  for (;;) {
+    int poll_count = poll(pfds, conn_count, http_loop_timeout(worker));
+
+    if (poll_count == -1) {
+      if (errno == EINTR)
+        continue;
+      exit(1);
+    }
+
+    bool woken = false;
+    for (int i = 0; i < conn_count; i++) {
+      if (!(pfds[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+        continue;
+      http_connection *conn = conns[i];
+      if (pfds[i].fd == worker->socket) {
+        // Takes the whole backlog rather than one connection per poll
+        while ((conn = http_accept(worker)) != NULL)
+          add_to_pfds(&pfds, &conns, conn->fd, conn, &conn_count, &fd_size);
+      } else if (pfds[i].fd == worker->wake[0]) {
+        woken = true;
+      } else if (conn->writing ? http_connection_write(worker, conn)
+                               : http_connection_read(worker, conn)) {
+        del_from_pfds(pfds, conns, i, &conn_count);
+        i--; // the last entry was swapped into this slot
+      } else if (conn->busy) {
+        // Negative fds are skipped by poll until the handler is done
+        pfds[i].fd = -pfds[i].fd - 1;
+      } else {
+        pfds[i].events = http_poll_events(conn);
+      }
+    }
+
+    if (woken) {
+      http_connection *conn = http_worker_take_done(worker);
+      while (conn != NULL) {
+        http_connection *next = conn->next_done;
+        int index = conn->poll_index;
+        http_connection_resume(conn);
+        if (http_connection_serve(worker, conn)) {
+          del_from_pfds(pfds, conns, index, &conn_count);
+        } else if (!conn->busy) {
+          pfds[index].fd = conn->fd; // watch it again
+          pfds[index].events = http_poll_events(conn);
+        }
+        conn = next;
+      }
+      if (http_worker_handed_off(worker))
+        pfds[0].fd = -1;
+    }
+
+    http_worker_sweep(worker);
+    if (http_worker_drained(worker))
+      break;
+  }
+
+  free(conns);
+  free(pfds);
+}
+
+#ifdef __linux__
+static void http_listen_epoll(http_worker *worker) {
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    perror("epoll_create1");
+    http_listen_poll(worker);
+    return;
+  }
+
+  // The listening socket is registered with a NULL data pointer, clients
+  // with their http_connection
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, worker->socket, &ev) == -1) {
+    perror("epoll_ctl");
+    close(epfd);
+    http_listen_poll(worker);
+    return;
+  }
+
+  struct epoll_event wev = {.events = EPOLLIN | EPOLLET,
+                            .data.ptr = worker->wake};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, worker->wake[0], &wev) == -1) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+
+  struct epoll_event events[HTTP_EPOLL_BATCH];
+
+  for (;;) {
+    int n = epoll_wait(epfd, events, HTTP_EPOLL_BATCH,
+                       http_loop_timeout(worker));
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      exit(1);
+    }
+
+    // Completions are resumed after the batch: resuming may close a
+    // connection that a later event in the batch still points to
+    bool woke = false;
+    for (int i = 0; i < n; i++) {
+      http_connection *conn = events[i].data.ptr;
+      if (conn == NULL) {
+        // Edge-triggered: keep accepting until the backlog is empty
+        while ((conn = http_accept(worker)) != NULL) {
+          // EPOLLOUT only fires after a send found the socket full
+          struct epoll_event cev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP |
+                                              EPOLLET,
+                                    .data.ptr = conn};
+          if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &cev) == -1)
+            http_connection_close(conn);
+        }
+      } else if (events[i].data.ptr == worker->wake) {
+        woke = true;
+      } else if (conn->lingering) {
+        continue; // reaped by the sweep
+      } else if (conn->writing) {
+        if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+          http_connection_write(worker, conn);
+      } else if (!conn->busy) {
+        // Closing a connection drops its fd from the epoll set
+        http_connection_read(worker, conn);
+      }
+    }
+
+    http_connection *conn = woke ? http_worker_take_done(worker) : NULL;
+    while (conn != NULL) {
+      http_connection *next = conn->next_done;
+      http_connection_resume(conn);
+      // Data that arrived while busy raised no new edge, read it now
+      if (!http_connection_serve(worker, conn) && !conn->busy &&
+          !conn->writing)
+        http_connection_read(worker, conn);
+      conn = next;
+    }
+    if (woke && http_worker_handed_off(worker))
+      epoll_ctl(epfd, EPOLL_CTL_DEL, worker->socket, NULL);
+
+    http_worker_sweep(worker);
+    if (http_worker_drained(worker))
+      break;
+  }
+
+  close(epfd);
+}
+#endif
+
+#ifdef HTTP_WITH_URING
+#define HTTP_URING_ENTRIES 256
+#define HTTP_URING_BUFS 256 // must be a power of two
+#define HTTP_URING_BGID 0
+
+/* Completion-based backend. The listening socket carries one multishot
+ * accept, every client one outstanding recv that picks a buffer from a
+ * provided-buffer ring. A kept-alive connection's response goes out as a
+ * plain send and its next recv is armed once that completes; the last
+ * response on a connection is linked to the close so the pair costs one
+ * submission. The operation is tagged in the low bits of the user_data, the
+ * rest is the http_connection pointer. */
+enum {
+  URING_ACCEPT,
+  URING_RECV,
+  URING_SEND,
+  URING_CLOSE,
+  URING_WAKE,
+  URING_CANCEL
+};
+#define URING_OP_MASK 7
+
+typedef struct http_uring {
+  struct io_uring ring;
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  char wake_buf[64];
+} http_uring;
+
+static struct io_uring_sqe *uring_get_sqe(http_uring *u) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+  if (sqe == NULL) {
+    io_uring_submit(&u->ring);
+    sqe = io_uring_get_sqe(&u->ring);
+  }
+  return sqe;
+}
+
+static void uring_set_data(struct io_uring_sqe *sqe, http_connection *conn,
+                           int op) {
+  io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)conn | op);
+}
+
+// Clients are non-blocking like under the other backends: the ring polls
+// them by itself, and a response a handler sends straight from the loop
+// (see http_connection_send_iov) must not wait on a slow reader
+static void uring_arm_accept(http_uring *u, http_worker *worker) {
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  io_uring_prep_multishot_accept(sqe, worker->socket, NULL, NULL,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+  uring_set_data(sqe, NULL, URING_ACCEPT);
+}
+
+// Asks for no more than conn->buf has room for, so like under the other
+// backends whatever does not fit waits in the socket
+static void uring_arm_recv(http_uring *u, http_connection *conn) {
+  int room = conn->cap - conn->len;
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  io_uring_prep_recv(sqe, conn->fd, NULL,
+                     room < HTTP_READ_BUF_SIZE ? room : HTTP_READ_BUF_SIZE, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = HTTP_URING_BGID;
+  uring_set_data(sqe, conn, URING_RECV);
+}
+
+// Stops the multishot accept once the listening socket was handed off; the
+// cancellation's own completion is ignored
+static void uring_cancel_accept(http_uring *u) {
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  io_uring_prep_cancel64(sqe, (uint64_t)URING_ACCEPT, 0);
+  uring_set_data(sqe, NULL, URING_CANCEL);
+}
+
+static void uring_arm_wake(http_uring *u, http_worker *worker) {
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  io_uring_prep_read(sqe, worker->wake[0], u->wake_buf, sizeof u->wake_buf,
+                     0);
+  uring_set_data(sqe, NULL, URING_WAKE);
+}
+
+// Submits the output queue as one sendmsg, linked to a close when it holds
+// the connection's last response
+static void uring_send(http_uring *u, http_connection *conn, bool last) {
+  if (io_uring_sq_space_left(&u->ring) < 2)
+    io_uring_submit(&u->ring);
+
+  int n = http_out_iov(conn, conn->iov, HTTP_IOV_BATCH);
+  http_out *rest = conn->out_head;
+  for (int i = 0; i < n; i++)
+    rest = rest->next;
+
+  conn->msg = (struct msghdr){.msg_iov = conn->iov, .msg_iovlen = n};
+  conn->sending = true;
+  conn->linked_close = last && rest == NULL;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  io_uring_prep_sendmsg(sqe, conn->fd, &conn->msg,
+                        MSG_NOSIGNAL | (conn->linked_close ? MSG_WAITALL : 0));
+  uring_set_data(sqe, conn, URING_SEND);
+  if (!conn->linked_close)
+    return;
+
+  sqe->flags |= IOSQE_IO_LINK;
+  sqe = uring_get_sqe(u);
+  io_uring_prep_close(sqe, conn->fd);
+  uring_set_data(sqe, conn, URING_CLOSE);
+}
+
+/* Moves a connection along after any completion. At most one operation is
+ * in flight per connection: a recv, a send (maybe linked to its close) or
+ * the handler thread that owns it while busy. */
+static void uring_serve(http_uring *u, http_worker *worker,
+                        http_connection *conn) {
+  if (conn->sending)
+    return; // picked up again when the send completes
+  http_connection_process(worker, conn);
+  // Full with nothing left to serve and no room to grow: the request is
+  // larger than the limits allow
+  if (!conn->busy && !conn->closing && conn->len == conn->cap &&
+      http_connection_grow(conn) == -1)
+    http_connection_refuse(conn, conn->parser.state <= HTTP_PARSE_HEADERS
+                                     ? HTTP_HEADERS_TOO_LARGE
+                                     : HTTP_PAYLOAD_TOO_LARGE);
+
+  // A busy connection's queue belongs to its handler thread, which may be
+  // streaming a response through it
+  bool last = conn->closing && !conn->busy;
+  if (conn->out_head != NULL && !conn->busy)
+    uring_send(u, conn, last);
+  else if (last) {
+    http_connection_close(conn);
+    return;
+  } else if (!conn->busy)
+    uring_arm_recv(u, conn);
+  http_connection_arm(conn);
+}
+
+static void uring_on_send(http_uring *u, http_worker *worker,
+                          http_connection *conn, struct io_uring_cqe *cqe) {
+  conn->sending = false;
+  if (cqe->res > 0)
+    http_out_consume(conn, cqe->res);
+  else
+    http_out_consume(conn, (size_t)-1); // give up on the rest
+  if (conn->linked_close)
+    return; // the close reports separately
+  if (cqe->res <= 0) {
+    http_connection_close(conn);
+    return;
+  }
+  uring_serve(u, worker, conn);
+}
+
+static void uring_on_close(http_uring *u, http_worker *worker,
+                           http_connection *conn, struct io_uring_cqe *cqe) {
+  conn->linked_close = false;
+  // A short send breaks the link and cancels the close
+  if (cqe->res == -ECANCELED) {
+    uring_serve(u, worker, conn);
+    return;
+  }
+  conn->fd = -1; // already closed by the ring
+  http_connection_close(conn);
+}
+
+static void uring_recycle_buf(http_uring *u, int bid) {
+  io_uring_buf_ring_add(u->buf_ring, u->bufs + bid * HTTP_READ_BUF_SIZE,
+                        HTTP_READ_BUF_SIZE, bid,
+                        io_uring_buf_ring_mask(HTTP_URING_BUFS), 0);
+  io_uring_buf_ring_advance(u->buf_ring, 1);
+}
+
+static void uring_on_recv(http_uring *u, http_worker *worker,
+                          http_connection *conn, struct io_uring_cqe *cqe) {
+  if (cqe->res == -ENOBUFS) {
+    // Every provided buffer is in flight, retry once some are recycled
+    uring_arm_recv(u, conn);
+    return;
+  }
+  if (cqe->res <= 0) {
+    http_connection_close(conn);
+    return;
+  }
+
+  int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  memcpy(conn->buf + conn->len, u->bufs + bid * HTTP_READ_BUF_SIZE, cqe->res);
+  conn->len += cqe->res;
+  conn->last_active = http_now_ms();
+  uring_recycle_buf(u, bid);
+
+  uring_serve(u, worker, conn);
+}
+
+static int uring_setup(http_uring *u) {
+  if (io_uring_queue_init(HTTP_URING_ENTRIES, &u->ring, 0) < 0)
+    return -1;
+
+  int ret;
+  u->buf_ring = io_uring_setup_buf_ring(&u->ring, HTTP_URING_BUFS,
+                                        HTTP_URING_BGID, 0, &ret);
+  u->bufs = malloc((size_t)HTTP_URING_BUFS * HTTP_READ_BUF_SIZE);
+  if (u->buf_ring == NULL || u->bufs == NULL) {
+    if (u->buf_ring != NULL)
+      io_uring_free_buf_ring(&u->ring, u->buf_ring, HTTP_URING_BUFS,
+                             HTTP_URING_BGID);
+    free(u->bufs);
+    io_uring_queue_exit(&u->ring);
+    return -1;
+  }
+  for (int i = 0; i < HTTP_URING_BUFS; i++)
+    io_uring_buf_ring_add(u->buf_ring, u->bufs + i * HTTP_READ_BUF_SIZE,
+                          HTTP_READ_BUF_SIZE, i,
+                          io_uring_buf_ring_mask(HTTP_URING_BUFS), i);
+  io_uring_buf_ring_advance(u->buf_ring, HTTP_URING_BUFS);
+  return 0;
+}
+
+static void http_listen_uring(http_worker *worker) {
+  http_uring u = {0};
+  if (uring_setup(&u) == -1) {
+    fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+    http_listen_epoll(worker);
+    return;
+  }
+
+  uring_arm_accept(&u, worker);
+  uring_arm_wake(&u, worker);
+
+  for (;;) {
+    struct io_uring_cqe *first;
+    int ret;
+    int timeout = http_loop_timeout(worker);
+    if (timeout >= 0) {
+      struct __kernel_timespec ts = {.tv_sec = timeout / 1000,
+                                     .tv_nsec = (timeout % 1000) * 1000000LL};
+      ret = io_uring_submit_and_wait_timeout(&u.ring, &first, 1, &ts, NULL);
+    } else {
+      ret = io_uring_submit_and_wait(&u.ring, 1);
+    }
+    if (ret < 0 && ret != -ETIME) {
+      if (ret == -EINTR)
+        continue;
+      exit(1);
+    }
+
+    struct io_uring_cqe *cqe;
+    unsigned head, seen = 0;
+    io_uring_for_each_cqe(&u.ring, head, cqe) {
+      seen++;
+      uint64_t data = io_uring_cqe_get_data64(cqe);
+      http_connection *conn =
+          (http_connection *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+
+      switch (data & URING_OP_MASK) {
+      case URING_ACCEPT:
+        if (!(cqe->flags & IORING_CQE_F_MORE) && !worker->draining)
+          uring_arm_accept(&u, worker);
+        if (cqe->res < 0)
+          break;
+        conn = http_connection_new(worker, cqe->res);
+        if (conn != NULL)
+          uring_arm_recv(&u, conn);
+        break;
+      case URING_RECV:
+        uring_on_recv(&u, worker, conn, cqe);
+        break;
+      case URING_WAKE:
+        conn = http_worker_take_done(worker);
+        while (conn != NULL) {
+          http_connection *next = conn->next_done;
+          http_connection_resume(conn);
+          uring_serve(&u, worker, conn);
+          conn = next;
+        }
+        uring_arm_wake(&u, worker);
+        if (http_worker_handed_off(worker))
+          uring_cancel_accept(&u);
+        break;
+      case URING_SEND:
+        uring_on_send(&u, worker, conn, cqe);
+        break;
+      case URING_CLOSE:
+        uring_on_close(&u, worker, conn, cqe);
+        break;
+      }
+    }
+    io_uring_cq_advance(&u.ring, seen);
+
+    http_worker_sweep(worker);
+    if (http_worker_drained(worker))
+      break;
+  }
+
+  io_uring_free_buf_ring(&u.ring, u.buf_ring, HTTP_URING_BUFS,
+                         HTTP_URING_BGID);
+  free(u.bufs);
+  io_uring_queue_exit(&u.ring);
+}
+#endif
+
+// Runs one worker's event loop on the calling thread
+static void *http_worker_run(void *arg) {
+  http_worker *worker = arg;
+  struct http_server *server = worker->server;
+
+  worker->context = server->context;
+  if (server->worker_context != NULL)
+    worker->context = server->worker_context(worker->id, server->context);
+
+  worker->timers = timerwheel_create(http_now_ms(), HTTP_TIMER_TICK_MS);
+  if (worker->timers == NULL) {
+    perror("timerwheel_create");
+    exit(1);
+  }
+
+#ifdef HTTP_WITH_URING
+  if (server->backend == HTTP_BACKEND_IO_URING)
+    http_listen_uring(worker);
+  else
+#endif
+#ifdef __linux__
+  if (server->backend == HTTP_BACKEND_EPOLL)
+    http_listen_epoll(worker);
+  else
+#endif
+    http_listen_poll(worker);
+  timerwheel_destroy(worker->timers);
+  if (server->worker_context_free != NULL && worker->context != server->context)
+    server->worker_context_free(worker->id, worker->context);
+  return NULL;
+}
+
+void http_server_listen(struct http_server server) {
+  if (server.handler_threads > 0) {
+    server._pool =
+        http_pool_create(&server, server.handler_threads, server.handler_queue);
+    if (server._pool == NULL) {
+      perror("http_pool_create");
+      exit(1);
+    }
+  }
+
+  // Handler threads signal finished requests through the wake pipes, and
+  // the handoff thread that the listening sockets are gone
+  for (int i = 0; i < server._worker_count; i++) {
+    http_worker *worker = &server._workers[i];
+    worker->server = &server;
+    if (pipe(worker->wake) == -1 || set_nonblocking(worker->wake[0]) == -1 ||
+        set_nonblocking(worker->wake[1]) == -1) {
+      perror("pipe");
+      exit(1);
+    }
+    pthread_mutex_init(&worker->done_lock, NULL);
+  }
+  if (server.handoff_path != NULL)
+    server._handoff = http_handoff_start(&server);
+
+  // Worker 0 runs on the calling thread, the rest get their own
+  for (int i = 1; i < server._worker_count; i++) {
+    if (pthread_create(&server._workers[i].thread, NULL, http_worker_run,
+                       &server._workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  http_worker_run(&server._workers[0]);
+  for (int i = 1; i < server._worker_count; i++)
+    pthread_join(server._workers[i].thread, NULL);
+  // The loops only return once the handoff finished
+  if (server._handoff != NULL) {
+    pthread_join(server._handoff->thread, NULL);
+    free(server._handoff);
+  }
+
+  for (int i = 0; i < server._listener_count; i++)
+    close(server._workers[i].socket);
+  if (server._pool != NULL)
+    http_pool_destroy(server._pool);
+  for (int i = 0; i < server._worker_count; i++) {
+    close(server._workers[i].wake[0]);
+    close(server._workers[i].wake[1]);
+    pthread_mutex_destroy(&server._workers[i].done_lock);
+  }
+  filecache_destroy(server._files);
+  compress_cache_destroy(server._compressed);
+  free(server._workers);
+  freeaddrinfo(server.res);
 }
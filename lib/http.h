@@ -2,6 +2,7 @@
 #define HTTP_H
 
 #include <netdb.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <sys/socket.h>
 
@@ -37,28 +38,193 @@ typedef struct http_request_line {
   enum http_version http_version;
 } http_request_line;
 
+// Headers the parser picks out as it reads them, so their values are found
+// without comparing names, see http_get_known_header
+enum http_header_id {
+  HTTP_HEADER_HOST,
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_CONTENT_TYPE,
+  HTTP_HEADER_CONNECTION,
+  HTTP_HEADER_ACCEPT,
+  HTTP_HEADER_ACCEPT_ENCODING,
+  HTTP_HEADER_IF_NONE_MATCH,
+  HTTP_HEADER_IF_MODIFIED_SINCE,
+  HTTP_HEADER_TRANSFER_ENCODING,
+  HTTP_HEADER_EXPECT,
+  HTTP_HEADER_USER_AGENT,
+  HTTP_HEADER_COOKIE,
+  HTTP_HEADER_AUTHORIZATION,
+  HTTP_HEADER_RANGE,
+  HTTP_HEADER_OTHER // any other header, and the number of those above
+};
+
+extern const char *const http_header_str[];
+
+#define HTTP_HEADER_TABLE_SIZE 16 // must be a power of two
+
 /* HTTP */
 typedef struct http_header {
   char *key;
   char *value;
   struct http_header *next;
+  struct http_header *_next_hash; // in its chain of headers->_table
 } http_header;
 
 typedef struct http_request_headers {
   struct http_header *head;
   struct http_header *tail;
   size_t size;
-  char *_header_buf;
   int _bufsize;
+  // First header of each well-known kind, NULL when the request has none
+  struct http_header *known[HTTP_HEADER_OTHER];
+  // The rest by hash of their lowercased name, in the order they came
+  struct http_header *_table[HTTP_HEADER_TABLE_SIZE];
 } http_request_headers;
 
+struct http_connection;
+
 typedef struct http_request {
   http_request_line *request_line;
   http_request_headers *headers;
+  // Whole request body, NUL-terminated. Empty when it was streamed to
+  // http_server_options.body_handler instead.
   char *body;
+  size_t body_len;
   int _client_fd;
+  bool _chunked; // response streamed with chunked coding
+  bool _aborted; // streamed response cannot be finished, see http_respond_end
+  struct http_connection *_conn;
+  // Holds the request and its parts when not NULL, see free_http_request
+  struct arena *_arena;
+  struct compress_stream *_deflate; // encodes the streamed response body
 } http_request;
 
+// Backend driving http_server_listen. POLL rescans every open socket per
+// wakeup and is kept as a portable fallback; EPOLL registers sockets
+// edge-triggered so wakeup cost scales with active connections; IO_URING
+// batches accept/recv/send/close into shared rings and needs a build with
+// URING=1, otherwise it degrades to EPOLL.
+enum http_backend {
+  HTTP_BACKEND_POLL,
+  HTTP_BACKEND_EPOLL,
+  HTTP_BACKEND_IO_URING
+};
+
+// http_server_options.workers value asking for one worker per online core
+#define HTTP_WORKERS_AUTO -1
+
+typedef struct http_server_options {
+  enum http_backend backend;
+  // Connections the kernel queues for each listening socket before it
+  // starts dropping SYNs; 0 picks a default. It caps this at
+  // net.core.somaxconn.
+  int listen_backlog;
+  // When > 0 (Linux only), connections are not handed over by accept until
+  // the client sends its request, or this many seconds have passed. Saves a
+  // wakeup per connection and keeps idle ones out of the loop.
+  int defer_accept_s;
+  // Optional path of a Unix socket for hot restarts. A server started while
+  // another one listens there takes over its listening sockets instead of
+  // binding the port, so no connection attempt is refused. The old server
+  // then stops accepting, finishes the requests it has (with keep-alive
+  // off) and returns from http_server_listen once its last connection is
+  // closed. Only processes of the same user may take over.
+  const char *handoff_path;
+  // Number of event loops, each on its own thread with its own SO_REUSEPORT
+  // listening socket. 0 or 1 keeps everything on the http_server_listen
+  // caller's thread.
+  int workers;
+  // Optional, called once on each worker's thread before its loop starts.
+  // The returned context is handed to the entrypoint for requests served by
+  // that worker, so per-thread resources (e.g. a sqlite3 handle) need no
+  // locking. Without it every worker shares the context given to init.
+  // Handler threads get one too, numbered after the workers.
+  void **(*worker_context)(int worker, void **context);
+  // Optional, releases a context worker_context returned (other than the one
+  // given to init) once http_server_listen is done with it: on the worker's
+  // own thread after its loop ends, and for handler threads after they were
+  // joined.
+  void (*worker_context_free)(int worker, void **context);
+  // When > 0 the entrypoint runs on this many handler threads instead of the
+  // I/O loop, so a slow handler does not stall other connections. They form
+  // a work-stealing scheduler, see http_handler_scheduler.
+  int handler_threads;
+  // Requests that may be handed to handler threads at once before new ones
+  // are refused with 503; 0 picks a default.
+  int handler_queue;
+  // Persistent connections (HTTP/1.1 by default, HTTP/1.0 on request) are
+  // closed after this many requests, <= 0 for no limit...
+  int keepalive_max_requests;
+  // ...or after sitting idle this long. <= 0 turns keep-alive off.
+  int keepalive_timeout_ms;
+  // Connections are dropped when a request's line and headers take longer
+  // than header_timeout_ms to arrive, counted from its first byte (from the
+  // accept for a connection's first request), or when its body stalls for
+  // body_timeout_ms. 0 picks a default, < 0 for no limit.
+  int header_timeout_ms, body_timeout_ms;
+  // Requests whose request line and headers exceed this many bytes are
+  // refused with 431; 0 picks a default.
+  int max_header_size;
+  // Requests declaring a larger body are refused with 413; 0 picks a default.
+  long max_body_size;
+  // Optional. Hands request bodies over piece by piece as they arrive
+  // instead of buffering them whole, so max_body_size does not apply. It runs
+  // on the I/O worker's thread with that worker's context: once per piece of
+  // body (len > 0), then once with len 0 when the body is complete, after
+  // which the entrypoint gets the request with an empty body. Returning
+  // non-zero refuses the request with 400 and closes the connection. When the
+  // entrypoint will not run (refused, or the connection failed first) the
+  // last call has data NULL.
+  int (*body_handler)(http_request *request, const char *data, size_t len,
+                      void **context);
+  // Optional. GET and HEAD requests whose path starts with static_prefix are
+  // answered with the file at the rest of the path under the static_root
+  // directory (index.html for directories) without reaching the entrypoint.
+  // Symlinks are followed only as far as they stay inside static_root.
+  const char *static_prefix;
+  const char *static_root;
+  // Files http_respond_file keeps open between requests; 0 picks a default.
+  int file_cache_size;
+  // Response bodies handed over with http_response.free_body that are at
+  // least this large go out with MSG_ZEROCOPY: the kernel sends them straight
+  // from the buffer instead of copying it, and the buffer is freed once the
+  // kernel reports it is done with it. Only pays off for bodies of tens of
+  // kilobytes and up; 0 turns it off. Ignored by the io_uring backend.
+  long zerocopy_threshold;
+  // Responses of a textual Content-Type (text/*, JSON, XML, JavaScript) with
+  // bodies at least this large are sent gzip- or deflate-encoded to clients
+  // whose Accept-Encoding allows it; streamed ones always are. 0 turns it
+  // off, as does a build without zlib. Responses setting Content-Encoding
+  // themselves are left alone.
+  long compress_min_size;
+  // zlib level to encode them at, 1 (fastest) to 9 (smallest); 0 picks a
+  // default.
+  int compress_level;
+  // Bytes of encoded bodies kept for responses that name a
+  // http_response.cache_key; 0 picks a default, < 0 keeps none.
+  long compress_cache_size;
+} http_server_options;
+
+struct http_server;
+
+typedef struct http_worker {
+  int id;
+  int socket;
+  pthread_t thread;
+  void **context;
+  struct http_server *server;
+  // Completions posted by handler threads, signalled through wake
+  int wake[2];
+  pthread_mutex_t done_lock;
+  struct http_connection *done;
+  struct http_connection *conns; // open connections
+  // Closed connections whose zero-copy sends the kernel still holds
+  struct http_connection *lingering;
+  bool draining; // listening sockets were handed off
+  long long last_sweep;
+  struct timerwheel *timers; // connections' deadlines
+} http_worker;
+
 typedef struct http_server {
   int _socket, _current_accept;
   struct sockaddr_storage _connecting_addr;
@@ -67,31 +233,161 @@ typedef struct http_server {
   void (*entrypoint)(http_request *, void **);
   int concurrent_connections;
   void **context;
+  enum http_backend backend;
+  int listen_backlog, defer_accept_s;
+  void **(*worker_context)(int worker, void **context);
+  void (*worker_context_free)(int worker, void **context);
+  http_worker *_workers;
+  int _worker_count;
+  // Distinct listening sockets, those of the first workers; workers past
+  // them share one when more were started than sockets were taken over
+  int _listener_count;
+  const char *handoff_path;
+  struct http_handoff *_handoff;
+  int handler_threads, handler_queue;
+  int keepalive_max_requests, keepalive_timeout_ms;
+  int header_timeout_ms, body_timeout_ms;
+  int max_header_size;
+  long max_body_size;
+  int (*body_handler)(http_request *request, const char *data, size_t len,
+                      void **context);
+  const char *static_prefix, *static_root;
+  long zerocopy_threshold;
+  long compress_min_size;
+  int compress_level;
+  struct compress_cache *_compressed;
+  struct filecache *_files;
+  struct http_pool *_pool;
 } http_server;
 
 typedef struct http_response {
   int status;
+  // Header lines, each ending in CRLF, as http_set_response_header builds
+  // them; the caller frees it. Content-Length and Connection are added when
+  // the response is sent.
   char *headers;
+  size_t _headers_len, _headers_cap;
+  // Written straight into the head when set, sparing the most common header
+  // a http_set_response_header call
+  const char *content_type;
   char *body;
+  // Length of body, which then need not be NUL-terminated; 0 measures it
+  // with strlen
+  size_t body_len;
+  // body was malloc'd and http_respond takes it over, freeing it once it is
+  // sent (or on failure). Saves copying a large body, and lets it go out
+  // with zero-copy sends, see http_server_options.zerocopy_threshold.
+  bool free_body;
+  // Optional. Names the body so its encoded form is kept and reused the
+  // next time the same body is sent under this key (e.g. the request URI of
+  // a popular query), see http_server_options.compress_cache_size. A body
+  // that changed is encoded afresh.
+  const char *cache_key;
 } http_response;
 
-enum http_status { HTTP_OK = 200, HTTP_NOT_FOUND = 404 };
+enum http_status {
+  HTTP_OK = 200,
+  HTTP_BAD_REQUEST = 400,
+  HTTP_NOT_FOUND = 404,
+  HTTP_METHOD_NOT_ALLOWED = 405,
+  HTTP_PAYLOAD_TOO_LARGE = 413,
+  HTTP_HEADERS_TOO_LARGE = 431,
+  HTTP_NOT_IMPLEMENTED = 501,
+  HTTP_SERVICE_UNAVAILABLE = 503
+};
 
 #define CONTENT_TYPE_TEXT "text/plain"
 #define CONTENT_TYPE_JSON "application/json"
 
+// Fills options with the defaults used when http_server_init gets NULL
+void http_server_default_options(http_server_options *options);
+
 http_server http_server_init(char *port,
                              void (*entrypoint)(http_request *, void **),
-                             void **context);
+                             void **context,
+                             const http_server_options *options);
 
 // Expects a heap-allocated http_request
-// Destroys input string
+// Destroys input string, which the parsed request points into
 int http_parse_request(char *request_str, http_request *request);
 
+// Serves until the listening sockets were handed off to a successor (see
+// http_server_options.handoff_path) and every connection is closed, then
+// releases everything the server holds and returns.
 void http_server_listen(struct http_server server);
 
 int http_respond(struct http_response *response, struct http_request *request);
 
+// Responds with the file at path, sent straight from the page cache with
+// sendfile. Content-Type is guessed from the extension and HEAD requests get
+// the headers alone. Open descriptors and stat results are cached, so a hot
+// file costs no open or stat calls. Returns -1 without responding when path
+// is not a readable regular file; otherwise the request is freed as with
+// http_respond. Only for requests received by the server.
+int http_respond_file(struct http_response *response,
+                      struct http_request *request, const char *path);
+
+// Streams a response whose length is not known up front. http_respond_begin
+// sends the status line and headers (response->body is ignored), each
+// http_respond_write sends one piece of the body right away and
+// http_respond_end finishes it. HTTP/1.1 clients get the body with chunked
+// transfer-encoding; older ones get it delimited by the connection closing.
+// The request stays valid until http_respond_end, which frees it like
+// http_respond does. All three return -1 once the response cannot be
+// completed, because the client is gone or the head could not be built;
+// from then on writes do nothing and http_respond_end behaves like
+// http_respond_abort.
+int http_respond_begin(struct http_response *response,
+                       struct http_request *request);
+int http_respond_write(struct http_request *request, const char *data,
+                       size_t len);
+int http_respond_end(struct http_request *request);
+// Gives up on a streamed response instead of finishing it, for a handler
+// that fails partway: the body is left unterminated, so a client reading
+// chunks or a compressed body can tell it was cut short, and the
+// connection is closed once what was already sent goes out. Frees the
+// request like http_respond_end.
+void http_respond_abort(struct http_request *request);
+
+// Value of the first header called name, compared case-insensitively, NULL
+// when the request has none. Well-known names take no string comparisons,
+// others are found through a hash table.
+const char *http_get_header(const struct http_request *request,
+                            const char *name);
+
+const char *http_get_known_header(const struct http_request *request,
+                                  enum http_header_id id);
+
+// One key=value pair of a query string. Both point into the request URI and
+// are still percent-encoded; a key without '=' has an empty value.
+typedef struct http_query_param {
+  const char *key;
+  size_t key_len;
+  const char *value;
+  size_t value_len;
+} http_query_param;
+
+// Walks the pairs of a URI's query string without copying or decoding them
+typedef struct http_query {
+  const char *next, *end;
+} http_query;
+
+void http_query_init(http_query *query, const char *uri);
+
+// Fills param with the next pair, false once there are none left
+bool http_query_next(http_query *query, http_query_param *param);
+
+// Percent-decodes len bytes of src into dst, '+' as a space, and
+// NUL-terminates it. Returns the decoded length, or -1 when that does not
+// fit in size bytes. Malformed escapes are kept as they are.
+long http_query_decode(const char *src, size_t len, char *dst, size_t size);
+
+// Decodes into buf the value of the first pair whose decoded key is key.
+// Returns its length, -1 when the query has no such key, or -2 when the
+// value does not fit in size bytes.
+long http_query_get(const struct http_request *request, const char *key,
+                    char *buf, size_t size);
+
 void http_set_response_status(struct http_response *response, int status);
 
 void http_set_response_header(struct http_response *response, char *key,
@@ -99,4 +395,12 @@ void http_set_response_header(struct http_response *response, char *key,
 char *http_headers_to_string(struct http_request_headers *headers,
                              bool pretty_print);
 
+struct scheduler;
+
+// Scheduler running the calling handler, NULL when handlers run inline on the
+// I/O loop. Pass it to scheduler_spawn/scheduler_wait to split a request's
+// work (e.g. serializing a large result set) across handler threads;
+// scheduler_spawn runs the task inline when given NULL.
+struct scheduler *http_handler_scheduler(void);
+
 #endif
@@ -0,0 +1,267 @@
+#include "router.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HTTP_ROUTER_METHODS (UNLINK + 1)
+
+/* A node is reached by the literal bytes of its prefix, or by one path
+ * segment when it is its parent's param child. Literal children start with
+ * distinct bytes, so at most one of them can match. */
+typedef struct http_route_node {
+  char *prefix;
+  size_t len;
+  struct http_route_node *children; // literal, linked through next
+  struct http_route_node *next;
+  struct http_route_node *param; // matches one segment, named by its name
+  char *name;
+  http_route_handler handler; // for paths ending here
+  http_route_handler rest;    // for any path going on from here...
+  char *rest_name;            // ...which is handed over as this parameter
+} http_route_node;
+
+struct http_router {
+  http_route_node *roots[HTTP_ROUTER_METHODS];
+};
+
+static http_route_node *http_route_node_new(const char *prefix, size_t len) {
+  http_route_node *node = calloc(1, sizeof(http_route_node));
+  if (node == NULL)
+    return NULL;
+  node->prefix = strndup(prefix, len);
+  if (node->prefix == NULL) {
+    free(node);
+    return NULL;
+  }
+  node->len = len;
+  return node;
+}
+
+static void http_route_node_free(http_route_node *node) {
+  while (node != NULL) {
+    http_route_node *next = node->next;
+    http_route_node_free(node->children);
+    http_route_node_free(node->param);
+    free(node->prefix);
+    free(node->name);
+    free(node->rest_name);
+    free(node);
+    node = next;
+  }
+}
+
+http_router *http_router_create(void) {
+  return calloc(1, sizeof(http_router));
+}
+
+void http_router_destroy(http_router *router) {
+  if (router == NULL)
+    return;
+  for (int i = 0; i < HTTP_ROUTER_METHODS; i++)
+    http_route_node_free(router->roots[i]);
+  free(router);
+}
+
+// Splits node after its first at bytes, moving everything below it to a
+// new child holding the rest of the prefix
+static int http_route_node_split(http_route_node *node, size_t at) {
+  http_route_node *tail = http_route_node_new(node->prefix + at,
+                                              node->len - at);
+  if (tail == NULL)
+    return -1;
+  tail->children = node->children;
+  tail->param = node->param;
+  tail->handler = node->handler;
+  tail->rest = node->rest;
+  tail->rest_name = node->rest_name;
+  node->len = at;
+  node->prefix[at] = '\0';
+  node->children = tail;
+  node->param = NULL;
+  node->handler = NULL;
+  node->rest = NULL;
+  node->rest_name = NULL;
+  return 0;
+}
+
+int http_router_add(http_router *router, enum http_method method,
+                    const char *path, http_route_handler handler) {
+  if ((unsigned)method >= HTTP_ROUTER_METHODS || path[0] != '/' ||
+      handler == NULL)
+    return -1;
+  if (router->roots[method] == NULL &&
+      (router->roots[method] = http_route_node_new("", 0)) == NULL)
+    return -1;
+
+  http_route_node *node = router->roots[method];
+  const char *p = path;
+  while (*p != '\0') {
+    // Parameters take up whole segments
+    bool segment_start = p > path && p[-1] == '/';
+    if (segment_start && (*p == ':' || *p == '*')) {
+      const char *name = p + 1;
+      size_t name_len = strcspn(name, "/");
+      if (name_len == 0)
+        return -1;
+      if (*p == '*') {
+        if (name[name_len] != '\0' || node->rest != NULL)
+          return -1;
+        if ((node->rest_name = strndup(name, name_len)) == NULL)
+          return -1;
+        node->rest = handler;
+        return 0;
+      }
+      if (node->param == NULL) {
+        if ((node->param = http_route_node_new("", 0)) == NULL)
+          return -1;
+        if ((node->param->name = strndup(name, name_len)) == NULL)
+          return -1;
+      } else if (strlen(node->param->name) != name_len ||
+                 strncmp(node->param->name, name, name_len) != 0) {
+        return -1;
+      }
+      node = node->param;
+      p = name + name_len;
+      continue;
+    }
+
+    // Literal bytes up to the next parameter
+    size_t run = 1;
+    while (p[run] != '\0' &&
+           !(p[run - 1] == '/' && (p[run] == ':' || p[run] == '*')))
+      run++;
+    http_route_node *child = node->children;
+    while (child != NULL && child->prefix[0] != p[0])
+      child = child->next;
+    if (child == NULL) {
+      if ((child = http_route_node_new(p, run)) == NULL)
+        return -1;
+      child->next = node->children;
+      node->children = child;
+      node = child;
+      p += run;
+      continue;
+    }
+    size_t common = 0;
+    while (common < child->len && common < run &&
+           child->prefix[common] == p[common])
+      common++;
+    if (common < child->len && http_route_node_split(child, common) != 0)
+      return -1;
+    node = child;
+    p += common;
+  }
+  if (node->handler != NULL)
+    return -1;
+  node->handler = handler;
+  return 0;
+}
+
+// Handler for the len bytes of path below node, whose own prefix is already
+// matched. Literal children are tried first, then the parameter, then a
+// rest route, backing out of each that leads nowhere.
+static http_route_handler http_route_match(const http_route_node *node,
+                                           const char *path, size_t len,
+                                           http_route_params *params) {
+  if (len == 0 && node->handler != NULL)
+    return node->handler;
+  if (len > 0) {
+    const http_route_node *child = node->children;
+    while (child != NULL && child->prefix[0] != path[0])
+      child = child->next;
+    if (child != NULL && child->len <= len &&
+        memcmp(child->prefix, path, child->len) == 0) {
+      http_route_handler handler = http_route_match(
+          child, path + child->len, len - child->len, params);
+      if (handler != NULL)
+        return handler;
+    }
+
+    size_t segment = 0;
+    while (segment < len && path[segment] != '/')
+      segment++;
+    if (node->param != NULL && segment > 0 &&
+        params->count < HTTP_ROUTE_MAX_PARAMS) {
+      int i = params->count++;
+      params->items[i].name = node->param->name;
+      params->items[i].value = path;
+      params->items[i].len = segment;
+      http_route_handler handler = http_route_match(
+          node->param, path + segment, len - segment, params);
+      if (handler != NULL)
+        return handler;
+      params->count--;
+    }
+  }
+  if (node->rest != NULL && params->count < HTTP_ROUTE_MAX_PARAMS) {
+    int i = params->count++;
+    params->items[i].name = node->rest_name;
+    params->items[i].value = path;
+    params->items[i].len = len;
+    return node->rest;
+  }
+  return NULL;
+}
+
+int http_router_dispatch(http_router *router, http_request *request,
+                         void **context, unsigned *allowed) {
+  const char *uri = request->request_line->request_uri;
+  size_t len = strcspn(uri, "?#");
+  unsigned method = request->request_line->method;
+  http_route_params params = {0};
+
+  http_route_handler handler = NULL;
+  if (allowed != NULL)
+    *allowed = 0;
+  if (method < HTTP_ROUTER_METHODS && router->roots[method] != NULL)
+    handler = http_route_match(router->roots[method], uri, len, &params);
+  // HEAD is GET without the body, which http_respond leaves out
+  if (handler == NULL && method == HEAD && router->roots[GET] != NULL) {
+    params.count = 0;
+    handler = http_route_match(router->roots[GET], uri, len, &params);
+  }
+  if (handler != NULL) {
+    handler(request, &params, context);
+    return 0;
+  }
+
+  // Every method is looked at, since a 405 must list all that would do
+  unsigned methods = 0;
+  for (int other = 0; other < HTTP_ROUTER_METHODS; other++) {
+    params.count = 0;
+    if (router->roots[other] != NULL &&
+        http_route_match(router->roots[other], uri, len, &params) != NULL)
+      methods |= 1u << other;
+  }
+  if (methods & (1u << GET))
+    methods |= 1u << HEAD;
+  if (allowed != NULL)
+    *allowed = methods;
+  return methods != 0 ? HTTP_METHOD_NOT_ALLOWED : HTTP_NOT_FOUND;
+}
+
+void http_router_format_allow(unsigned allowed, char *buf, size_t size) {
+  size_t len = 0;
+  if (size > 0)
+    buf[0] = '\0';
+  for (int method = 0; method < HTTP_ROUTER_METHODS; method++) {
+    if (!(allowed & (1u << method)) || len >= size)
+      continue;
+    int n = snprintf(buf + len, size - len, "%s%s", len > 0 ? ", " : "",
+                     http_method_str[method]);
+    len += n > 0 ? (size_t)n : 0;
+  }
+}
+
+const char *http_route_param(const http_route_params *params,
+                             const char *name, size_t *len) {
+  for (int i = 0; i < params->count; i++) {
+    if (strcmp(params->items[i].name, name) == 0) {
+      if (len != NULL)
+        *len = params->items[i].len;
+      return params->items[i].value;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "http.h"
+#include <stddef.h>
+
+/* Dispatches requests to handlers by method and path. Each method has a
+ * compressed radix tree of its routes: a path is matched by walking it once
+ * from the root, comparing whole shared prefixes at a time, so finding the
+ * handler takes time in the length of the path however many routes there
+ * are. A route segment written ":name" matches any one path segment, and a
+ * route ending in "*name" matches the rest of the path; literal segments win
+ * over them when both fit. Routes are added before the server starts and
+ * only read afterwards, so a router may be shared between threads. */
+
+typedef struct http_router http_router;
+
+#define HTTP_ROUTE_MAX_PARAMS 8
+
+// Path segments a route's parameters matched, pointing into the request URI
+typedef struct http_route_params {
+  int count;
+  struct {
+    const char *name;
+    const char *value; // not NUL-terminated
+    size_t len;
+  } items[HTTP_ROUTE_MAX_PARAMS];
+} http_route_params;
+
+// params is only valid for the duration of the call
+typedef void (*http_route_handler)(http_request *request,
+                                   const http_route_params *params,
+                                   void **context);
+
+http_router *http_router_create(void);
+
+void http_router_destroy(http_router *router);
+
+// Routes requests for method and path, which starts with '/', to handler.
+// Returns -1 when path is malformed, clashes with a route added before
+// (the same route, or a parameter of another name in the same place) or
+// memory runs out.
+int http_router_add(http_router *router, enum http_method method,
+                    const char *path, http_route_handler handler);
+
+// Runs the handler of the route matching request's method and path (the
+// query string is ignored) and returns 0. HEAD requests fall back to the
+// GET route when the path has no HEAD one. Without one nothing is sent and
+// the status to answer with is returned: HTTP_METHOD_NOT_ALLOWED when the
+// path has routes for other methods, else HTTP_NOT_FOUND. allowed, when not
+// NULL, gets the methods the path has routes for as bits 1u << method.
+int http_router_dispatch(http_router *router, http_request *request,
+                         void **context, unsigned *allowed);
+
+// Writes the methods in allowed (as from http_router_dispatch) into buf as
+// the value of an Allow header, e.g. "GET, POST", truncating to size bytes
+void http_router_format_allow(unsigned allowed, char *buf, size_t size);
+
+// Value of the parameter called name and its length in *len, NULL when the
+// route has none by that name
+const char *http_route_param(const http_route_params *params,
+                             const char *name, size_t *len);
+
+#endif
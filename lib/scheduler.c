@@ -0,0 +1,420 @@
+#include "scheduler.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define SCHEDULER_DEQUE_SIZE 4096 // must be a power of two
+#define SCHEDULER_DEQUE_MASK (SCHEDULER_DEQUE_SIZE - 1)
+#define SCHEDULER_STEAL_ROUNDS 2
+#define SCHEDULER_WAIT_SPINS 64 // yields before scheduler_wait sleeps
+// Set in a group's pending count while its waiter sleeps on it
+#define SCHEDULER_GROUP_PARKED (1 << 30)
+
+typedef struct scheduler_task {
+  scheduler_fn fn;
+  void *arg;
+  scheduler_group *group;
+  struct scheduler_task *next;
+} scheduler_task;
+
+/* Chase-Lev deque with a fixed ring, after "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (Le et al., 2013). Only the owner
+ * touches bottom; thieves race each other and the owner's last pop on top.
+ *
+ *  top                      bottom
+ *   ↓                          ↓
+ *  [t0][t1][t2] ... [tn-1][  ]
+ *   ↑ steal                ↑ push / take
+ */
+typedef struct scheduler_deque {
+  atomic_llong top;
+  atomic_llong bottom;
+  scheduler_task *_Atomic buf[SCHEDULER_DEQUE_SIZE];
+} scheduler_deque;
+
+// FIFO for tasks submitted by threads outside the scheduler
+typedef struct scheduler_inbox {
+  pthread_mutex_t lock;
+  scheduler_task *head, *tail;
+} scheduler_inbox;
+
+typedef struct scheduler_worker {
+  int id;
+  scheduler *owner;
+  pthread_t thread;
+  unsigned rng;
+  scheduler_deque deque;
+  scheduler_inbox inbox;
+} scheduler_worker;
+
+struct scheduler {
+  int thread_count;
+  scheduler_worker *workers;
+  void (*thread_init)(int id, void *arg);
+  void *arg;
+  atomic_int queued;   // tasks pushed but not yet taken, used for parking
+  atomic_int sleepers; // threads waiting on park
+  atomic_uint next_inbox;
+  atomic_bool stop;
+  pthread_mutex_t park_lock;
+  pthread_cond_t park;
+};
+
+static _Thread_local scheduler_worker *scheduler_tls;
+
+static int deque_push(scheduler_deque *d, scheduler_task *task) {
+  long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  long long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  if (b - t >= SCHEDULER_DEQUE_SIZE)
+    return -1;
+  atomic_store_explicit(&d->buf[b & SCHEDULER_DEQUE_MASK], task,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  return 0;
+}
+
+static scheduler_task *deque_take(scheduler_deque *d) {
+  long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+  if (t > b) { // empty
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return NULL;
+  }
+  scheduler_task *task = atomic_load_explicit(
+      &d->buf[b & SCHEDULER_DEQUE_MASK], memory_order_relaxed);
+  if (t == b) {
+    // Last element, race thieves for it
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+      task = NULL;
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+static scheduler_task *deque_steal(scheduler_deque *d) {
+  long long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  if (t >= b)
+    return NULL;
+  scheduler_task *task = atomic_load_explicit(
+      &d->buf[t & SCHEDULER_DEQUE_MASK], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed))
+    return NULL; // lost the race, caller moves on to another victim
+  return task;
+}
+
+static void inbox_push(scheduler_inbox *inbox, scheduler_task *task) {
+  task->next = NULL;
+  pthread_mutex_lock(&inbox->lock);
+  if (inbox->tail != NULL)
+    inbox->tail->next = task;
+  else
+    inbox->head = task;
+  inbox->tail = task;
+  pthread_mutex_unlock(&inbox->lock);
+}
+
+static scheduler_task *inbox_pop(scheduler_inbox *inbox, bool blocking) {
+  if (blocking)
+    pthread_mutex_lock(&inbox->lock);
+  else if (pthread_mutex_trylock(&inbox->lock) != 0)
+    return NULL;
+  scheduler_task *task = inbox->head;
+  if (task != NULL) {
+    inbox->head = task->next;
+    if (inbox->head == NULL)
+      inbox->tail = NULL;
+  }
+  pthread_mutex_unlock(&inbox->lock);
+  return task;
+}
+
+// xorshift32, good enough to spread steal attempts
+static unsigned next_random(unsigned *state) {
+  unsigned x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static void wake_one(scheduler *s) {
+  if (atomic_load(&s->sleepers) > 0) {
+    pthread_mutex_lock(&s->park_lock);
+    pthread_cond_signal(&s->park);
+    pthread_mutex_unlock(&s->park_lock);
+  }
+}
+
+// Own deque first, then own inbox, then random victims
+static scheduler_task *find_task(scheduler_worker *w) {
+  scheduler *s = w->owner;
+  scheduler_task *task = deque_take(&w->deque);
+  if (task == NULL)
+    task = inbox_pop(&w->inbox, true);
+
+  int attempts = SCHEDULER_STEAL_ROUNDS * s->thread_count;
+  for (int i = 0; task == NULL && i < attempts && s->thread_count > 1; i++) {
+    scheduler_worker *victim =
+        &s->workers[next_random(&w->rng) % s->thread_count];
+    if (victim == w)
+      continue;
+    task = deque_steal(&victim->deque);
+    if (task == NULL)
+      task = inbox_pop(&victim->inbox, false);
+  }
+
+  if (task != NULL)
+    atomic_fetch_sub(&s->queued, 1);
+  return task;
+}
+
+/* A waiter sleeps on the pending count itself, so waking it needs nothing
+ * but the count's address. The group usually lives on the waiter's stack and
+ * is gone as soon as it sees the count drop to zero; a wake reaching an
+ * address that is no longer a group is at worst a spurious one. */
+static void group_park(scheduler_group *group, int pending) {
+#ifdef __linux__
+  if (!(pending & SCHEDULER_GROUP_PARKED) &&
+      !atomic_compare_exchange_strong(&group->pending, &pending,
+                                      pending | SCHEDULER_GROUP_PARKED))
+    return; // changed under us, look again
+  syscall(SYS_futex, &group->pending, FUTEX_WAIT_PRIVATE,
+          pending | SCHEDULER_GROUP_PARKED, NULL, NULL, 0);
+#else
+  (void)group;
+  (void)pending;
+  sched_yield();
+#endif
+}
+
+static void run_task(scheduler_task *task) {
+  scheduler_group *group = task->group;
+  task->fn(task->arg);
+  free(task);
+  if (group != NULL &&
+      atomic_fetch_sub_explicit(&group->pending, 1, memory_order_release) ==
+          (SCHEDULER_GROUP_PARKED | 1)) {
+#ifdef __linux__
+    syscall(SYS_futex, &group->pending, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+            NULL, 0);
+#endif
+  }
+}
+
+static void *scheduler_thread(void *arg) {
+  scheduler_worker *w = arg;
+  scheduler *s = w->owner;
+  scheduler_tls = w;
+
+  if (s->thread_init != NULL)
+    s->thread_init(w->id, s->arg);
+
+  while (!atomic_load(&s->stop)) {
+    scheduler_task *task = find_task(w);
+    if (task != NULL) {
+      run_task(task);
+      continue;
+    }
+
+    // Registering as a sleeper before re-checking queued pairs with
+    // submitters bumping queued before reading sleepers, so no wakeup is lost
+    pthread_mutex_lock(&s->park_lock);
+    atomic_fetch_add(&s->sleepers, 1);
+    if (atomic_load(&s->queued) == 0 && !atomic_load(&s->stop))
+      pthread_cond_wait(&s->park, &s->park_lock);
+    atomic_fetch_sub(&s->sleepers, 1);
+    pthread_mutex_unlock(&s->park_lock);
+  }
+  return NULL;
+}
+
+scheduler *scheduler_create(int threads,
+                            void (*thread_init)(int id, void *arg), void *arg) {
+  if (threads < 1)
+    return NULL;
+  scheduler *s = calloc(1, sizeof(scheduler));
+  if (s == NULL)
+    return NULL;
+  s->workers = calloc(threads, sizeof(scheduler_worker));
+  if (s->workers == NULL) {
+    free(s);
+    return NULL;
+  }
+  s->thread_count = threads;
+  s->thread_init = thread_init;
+  s->arg = arg;
+  pthread_mutex_init(&s->park_lock, NULL);
+  pthread_cond_init(&s->park, NULL);
+
+  for (int i = 0; i < threads; i++) {
+    scheduler_worker *w = &s->workers[i];
+    w->id = i;
+    w->owner = s;
+    w->rng = 2463534242u + i * 7919u;
+    pthread_mutex_init(&w->inbox.lock, NULL);
+  }
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&s->workers[i].thread, NULL, scheduler_thread,
+                       &s->workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  return s;
+}
+
+void scheduler_destroy(scheduler *s) {
+  if (s == NULL)
+    return;
+  atomic_store(&s->stop, true);
+  pthread_mutex_lock(&s->park_lock);
+  pthread_cond_broadcast(&s->park);
+  pthread_mutex_unlock(&s->park_lock);
+
+  for (int i = 0; i < s->thread_count; i++)
+    pthread_join(s->workers[i].thread, NULL);
+
+  for (int i = 0; i < s->thread_count; i++) {
+    scheduler_worker *w = &s->workers[i];
+    scheduler_task *task;
+    while ((task = deque_take(&w->deque)) != NULL)
+      free(task);
+    while ((task = inbox_pop(&w->inbox, true)) != NULL)
+      free(task);
+    pthread_mutex_destroy(&w->inbox.lock);
+  }
+  pthread_mutex_destroy(&s->park_lock);
+  pthread_cond_destroy(&s->park);
+  free(s->workers);
+  free(s);
+}
+
+static int scheduler_push(scheduler *s, scheduler_task *task) {
+  atomic_fetch_add(&s->queued, 1);
+  scheduler_worker *w = scheduler_tls;
+  if (w == NULL || w->owner != s || deque_push(&w->deque, task) == -1) {
+    unsigned i = atomic_fetch_add(&s->next_inbox, 1) % s->thread_count;
+    inbox_push(&s->workers[i].inbox, task);
+  }
+  wake_one(s);
+  return 0;
+}
+
+int scheduler_submit(scheduler *s, scheduler_fn fn, void *arg) {
+  scheduler_task *task = malloc(sizeof(scheduler_task));
+  if (task == NULL)
+    return -1;
+  *task = (scheduler_task){.fn = fn, .arg = arg};
+  return scheduler_push(s, task);
+}
+
+void scheduler_group_init(scheduler_group *group) {
+  atomic_init(&group->pending, 0);
+}
+
+void scheduler_spawn(scheduler *s, scheduler_group *group, scheduler_fn fn,
+                     void *arg) {
+  scheduler_task *task = s != NULL ? malloc(sizeof(scheduler_task)) : NULL;
+  if (task == NULL) {
+    fn(arg);
+    return;
+  }
+  *task = (scheduler_task){.fn = fn, .arg = arg, .group = group};
+  atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+  scheduler_push(s, task);
+}
+
+// Removes the oldest task of group from inbox, NULL when it holds none
+static scheduler_task *inbox_take_group(scheduler_inbox *inbox,
+                                        scheduler_group *group) {
+  if (pthread_mutex_trylock(&inbox->lock) != 0)
+    return NULL;
+  scheduler_task *prev = NULL, *task = inbox->head;
+  while (task != NULL && task->group != group) {
+    prev = task;
+    task = task->next;
+  }
+  if (task != NULL) {
+    if (prev != NULL)
+      prev->next = task->next;
+    else
+      inbox->head = task->next;
+    if (inbox->tail == task)
+      inbox->tail = prev;
+  }
+  pthread_mutex_unlock(&inbox->lock);
+  return task;
+}
+
+/* A task of group for a thread waiting on it. Only those are run: anything
+ * else (another request's handler, above all) would nest inside the waiting
+ * task's stack and could reenter whatever it is in the middle of. They are
+ * most likely at the bottom of w's own deque; tasks that overflowed it went
+ * to the inboxes instead. */
+static scheduler_task *find_group_task(scheduler_worker *w,
+                                       scheduler_group *group) {
+  scheduler *s = w->owner;
+  scheduler_task *task = deque_take(&w->deque);
+  if (task != NULL && task->group != group) {
+    deque_push(&w->deque, task); // back where it was, the slot is free
+    task = NULL;
+  }
+  for (int i = 0; task == NULL && i < s->thread_count; i++)
+    task = inbox_take_group(&s->workers[(w->id + i) % s->thread_count].inbox,
+                            group);
+  if (task != NULL)
+    atomic_fetch_sub(&s->queued, 1);
+  return task;
+}
+
+void scheduler_wait(scheduler *s, scheduler_group *group) {
+  scheduler_worker *w = scheduler_tls;
+  int pending, spins = 0;
+  while (((pending = atomic_load_explicit(&group->pending,
+                                          memory_order_acquire)) &
+          ~SCHEDULER_GROUP_PARKED) > 0) {
+    // Help with the group instead of blocking; tasks of it other threads
+    // took are waited out, yielding for a while and then asleep until the
+    // last of them is done
+    scheduler_task *task = NULL;
+    if (w != NULL && w->owner == s)
+      task = find_group_task(w, group);
+    if (task != NULL) {
+      run_task(task);
+      spins = 0;
+    } else if (++spins < SCHEDULER_WAIT_SPINS) {
+      sched_yield();
+    } else {
+      group_park(group, pending);
+    }
+  }
+  // Nothing is left to wake it, and the group can be used again
+  atomic_store_explicit(&group->pending, 0, memory_order_relaxed);
+}
+
+scheduler *scheduler_self(void) {
+  return scheduler_tls != NULL ? scheduler_tls->owner : NULL;
+}
+
+int scheduler_current_id(void) {
+  return scheduler_tls != NULL ? scheduler_tls->id : -1;
+}
@@ -0,0 +1,51 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdatomic.h>
+
+/* Work-stealing task scheduler. Every scheduler thread owns a deque it
+ * pushes to and pops from at the bottom; idle threads steal from the top of a
+ * randomly chosen victim. Tasks submitted from outside the scheduler land in
+ * per-thread inboxes, picked round-robin, so there is no single shared queue.
+ */
+
+typedef struct scheduler scheduler;
+
+typedef void (*scheduler_fn)(void *arg);
+
+// Counts outstanding tasks spawned into it so a parent can wait for them
+typedef struct scheduler_group {
+  atomic_int pending;
+} scheduler_group;
+
+// Starts a scheduler with the given number of threads. thread_init, when not
+// NULL, runs first on every thread with its id (0..threads-1) and arg.
+scheduler *scheduler_create(int threads,
+                            void (*thread_init)(int id, void *arg), void *arg);
+
+// Stops and joins every thread. Tasks that never ran are dropped.
+void scheduler_destroy(scheduler *s);
+
+// Queues fn(arg) from any thread, returns -1 if it could not be queued
+int scheduler_submit(scheduler *s, scheduler_fn fn, void *arg);
+
+void scheduler_group_init(scheduler_group *group);
+
+// Queues fn(arg) as part of group. Called from a scheduler thread the task
+// goes onto that thread's own deque, where siblings can steal it. With s ==
+// NULL (not running on a scheduler) the task runs inline.
+void scheduler_spawn(scheduler *s, scheduler_group *group, scheduler_fn fn,
+                     void *arg);
+
+// Runs queued tasks of group on the calling thread until every task in it is
+// done, sleeping once only tasks other threads took are left. Other work is
+// left to other threads, so none nests inside the caller.
+void scheduler_wait(scheduler *s, scheduler_group *group);
+
+// Scheduler the calling thread belongs to, or NULL
+scheduler *scheduler_self(void);
+
+// Id of the calling scheduler thread, or -1
+int scheduler_current_id(void);
+
+#endif
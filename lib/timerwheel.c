@@ -0,0 +1,162 @@
+#include "timerwheel.h"
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+// 64^4 ticks, over two weeks at 100ms; later deadlines are brought forward
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SPAN (1LL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+
+// Slots and the expired list are circular lists headed by a sentinel
+struct timerwheel {
+  timerwheel_timer slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+  timerwheel_timer expired; // due, waiting to be handed out
+  long long current;        // next tick to process
+  int tick_ms;
+  int count; // scheduled timers, including expired ones
+};
+
+static void timerwheel_list_init(timerwheel_timer *head) {
+  head->prev = head->next = head;
+}
+
+static bool timerwheel_list_empty(const timerwheel_timer *head) {
+  return head->next == head;
+}
+
+static void timerwheel_list_push(timerwheel_timer *head,
+                                 timerwheel_timer *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static void timerwheel_unlink(timerwheel_timer *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = NULL;
+}
+
+timerwheel *timerwheel_create(long long now_ms, int tick_ms) {
+  timerwheel *wheel = malloc(sizeof(timerwheel));
+  if (wheel == NULL)
+    return NULL;
+  for (int level = 0; level < TIMERWHEEL_LEVELS; level++)
+    for (int slot = 0; slot < TIMERWHEEL_SLOTS; slot++)
+      timerwheel_list_init(&wheel->slots[level][slot]);
+  timerwheel_list_init(&wheel->expired);
+  wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+  wheel->current = now_ms / wheel->tick_ms;
+  wheel->count = 0;
+  return wheel;
+}
+
+void timerwheel_destroy(timerwheel *wheel) { free(wheel); }
+
+// Files timer in the slot of the coarsest level that still resolves its
+// distance from the current tick
+static void timerwheel_add(timerwheel *wheel, timerwheel_timer *timer) {
+  long long delta = timer->expires - wheel->current;
+  if (delta < 0) {
+    timer->expires = wheel->current;
+    delta = 0;
+  } else if (delta >= TIMERWHEEL_SPAN) {
+    timer->expires = wheel->current + TIMERWHEEL_SPAN - 1;
+    delta = TIMERWHEEL_SPAN - 1;
+  }
+  int level = 0;
+  while (delta >= 1LL << (TIMERWHEEL_BITS * (level + 1)))
+    level++;
+  int slot = (timer->expires >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+  timerwheel_list_push(&wheel->slots[level][slot], timer);
+}
+
+void timerwheel_schedule(timerwheel *wheel, timerwheel_timer *timer,
+                         long long expires_ms) {
+  timerwheel_cancel(wheel, timer);
+  // Rounded up, so a timer never fires before its deadline
+  timer->expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  timerwheel_add(wheel, timer);
+  wheel->count++;
+}
+
+void timerwheel_cancel(timerwheel *wheel, timerwheel_timer *timer) {
+  if (timer->next == NULL)
+    return;
+  timerwheel_unlink(timer);
+  wheel->count--;
+}
+
+// Refiles every timer of a slot whose turn has come, one level down or more
+static void timerwheel_cascade(timerwheel *wheel, int level, int slot) {
+  timerwheel_timer *head = &wheel->slots[level][slot];
+  timerwheel_timer *timer = head->next;
+  timerwheel_list_init(head);
+  while (timer != head) {
+    timerwheel_timer *next = timer->next;
+    timerwheel_add(wheel, timer);
+    timer = next;
+  }
+}
+
+// Moves a slot's timers to the end of the expired list
+static void timerwheel_splice_expired(timerwheel *wheel,
+                                      timerwheel_timer *head) {
+  if (timerwheel_list_empty(head))
+    return;
+  timerwheel_timer *expired = &wheel->expired;
+  head->next->prev = expired->prev;
+  expired->prev->next = head->next;
+  head->prev->next = expired;
+  expired->prev = head->prev;
+  timerwheel_list_init(head);
+}
+
+timerwheel_timer *timerwheel_expire(timerwheel *wheel, long long now_ms) {
+  long long now = now_ms / wheel->tick_ms;
+  while (timerwheel_list_empty(&wheel->expired)) {
+    if (wheel->count == 0) {
+      if (wheel->current < now)
+        wheel->current = now; // no need to walk the idle ticks
+      return NULL;
+    }
+    if (wheel->current > now)
+      return NULL;
+    long long tick = wheel->current;
+    // A finer ring wrapping around brings the next slot of the coarser one
+    for (int level = 1; level < TIMERWHEEL_LEVELS &&
+                        (tick & ((1LL << (TIMERWHEEL_BITS * level)) - 1)) == 0;
+         level++)
+      timerwheel_cascade(wheel, level,
+                         (tick >> (TIMERWHEEL_BITS * level)) &
+                             TIMERWHEEL_MASK);
+    timerwheel_splice_expired(wheel, &wheel->slots[0][tick & TIMERWHEEL_MASK]);
+    wheel->current++;
+  }
+  timerwheel_timer *timer = wheel->expired.next;
+  timerwheel_cancel(wheel, timer);
+  return timer;
+}
+
+int timerwheel_timeout(timerwheel *wheel, long long now_ms) {
+  if (wheel->count == 0)
+    return -1;
+  if (!timerwheel_list_empty(&wheel->expired))
+    return 0;
+  // The first busy slot of the finest ring, or else its wrapping around,
+  // which may cascade timers into it
+  long long tick = wheel->current;
+  while (timerwheel_list_empty(&wheel->slots[0][tick & TIMERWHEEL_MASK]) &&
+         ((tick + 1) & TIMERWHEEL_MASK) != 0)
+    tick++;
+  if (timerwheel_list_empty(&wheel->slots[0][tick & TIMERWHEEL_MASK]))
+    tick++;
+  long long ms = tick * wheel->tick_ms - now_ms;
+  if (ms <= 0)
+    return 0;
+  return ms < INT_MAX ? (int)ms : INT_MAX;
+}
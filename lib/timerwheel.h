@@ -0,0 +1,40 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+/* Hierarchical timing wheel. Timers are embedded in the objects they time
+ * and scheduling, cancelling and expiring one are all O(1), however many are
+ * pending: each level is a ring of slots, a timer sits in the slot of the
+ * coarsest level that still tells its deadline apart from now, and moves
+ * down a level each time the finer ring wraps around to it. Deadlines are
+ * rounded up to whole ticks. Not thread-safe; one wheel per event loop. */
+
+typedef struct timerwheel timerwheel;
+
+typedef struct timerwheel_timer {
+  long long expires; // in ticks
+  struct timerwheel_timer *prev, *next; // NULL while not scheduled
+} timerwheel_timer;
+
+// now_ms is the time on the clock later calls use, tick_ms its resolution
+timerwheel *timerwheel_create(long long now_ms, int tick_ms);
+
+// Pending timers are dropped, not fired
+void timerwheel_destroy(timerwheel *wheel);
+
+// (Re)schedules timer to fire at expires_ms. A timer must be zeroed or
+// cancelled before it is first scheduled.
+void timerwheel_schedule(timerwheel *wheel, timerwheel_timer *timer,
+                         long long expires_ms);
+
+// Does nothing for a timer that is not scheduled
+void timerwheel_cancel(timerwheel *wheel, timerwheel_timer *timer);
+
+// Next timer due by now_ms, already cancelled, NULL once there are none.
+// Timers may be scheduled and cancelled between calls.
+timerwheel_timer *timerwheel_expire(timerwheel *wheel, long long now_ms);
+
+// Milliseconds from now_ms until timerwheel_expire may next have a timer,
+// -1 when none are pending. Suits a poll timeout.
+int timerwheel_timeout(timerwheel *wheel, long long now_ms);
+
+#endif
@@ -1,6 +1,8 @@
 #include "lib/http.h"
 #include "lib/json.h"
+#include "lib/router.h"
 #include "lib/sqlite3.h"
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,59 +13,224 @@ typedef struct {
   size_t capacity;
 } CourseList;
 
-// Outputs a json object representing a course
+// Response a course search is streamed into, one row at a time
+typedef struct {
+  http_request *request;
+  size_t rows;
+  // Set to collect the response in body and send it whole instead
+  bool buffered;
+  bool begun; // the streamed response's head was sent, or failed to be
+  char *body;
+  size_t len, cap;
+} CourseStream;
+
+int course_stream_begin(CourseStream *stream) {
+  if (stream->buffered)
+    return 0;
+  stream->begun = true;
+  http_response response = {0};
+  http_set_response_status(&response, HTTP_OK);
+  response.content_type = CONTENT_TYPE_TEXT;
+  return http_respond_begin(&response, stream->request);
+}
+
+// Adds the next piece of the JSON array to the response
+int course_emit(CourseStream *stream, const char *data, size_t len) {
+  if (!stream->buffered)
+    return http_respond_write(stream->request, data, len);
+  if (stream->len + len > stream->cap) {
+    size_t cap = stream->cap > 0 ? stream->cap : 1024;
+    while (cap < stream->len + len)
+      cap *= 2;
+    char *body = realloc(stream->body, cap);
+    if (body == NULL)
+      return -1;
+    stream->body = body;
+    stream->cap = cap;
+  }
+  memcpy(stream->body + stream->len, data, len);
+  stream->len += len;
+  return 0;
+}
+
+// Sends a json object representing a course as the next array element
 int course_from_row(void *data, int argc, char **argv, char **azColName) {
-  json_element *outgoing = *((json_element **)data);
+  CourseStream *stream = data;
+  if (stream->rows == 0 && course_stream_begin(stream) != 0)
+    return 1;
+
   json_element *current_row = json_obj(0, 0);
-  json_append(outgoing, current_row);
   for (int i = 0; i < argc; i++) {
     json_set_key(current_row, azColName[i],
                  argv[i] ? json_str(argv[i]) : json_nul());
   }
-  return 0;
+  char *str = json_stringify(current_row, false);
+  json_free_element(current_row);
+  if (str == NULL)
+    return 1;
+
+  // Sent together with the separator in front of it
+  size_t len = strlen(str);
+  char *piece = malloc(len + 1);
+  if (piece == NULL) {
+    free(str);
+    return 1;
+  }
+  piece[0] = stream->rows++ == 0 ? '[' : ',';
+  memcpy(piece + 1, str, len);
+  free(str);
+  int rc = course_emit(stream, piece, len + 1);
+  free(piece);
+  return rc != 0;
 }
 
-char *search_course(sqlite3 *db, char *err_msg) {
-  json_element *outgoing = json_arr(0);
+// Streams courses of department, which is lowercase, as a JSON array, or
+// sends it in one piece when buffered. Returns -1 without responding if
+// the query failed before producing a row (before finishing, when
+// buffered). A stream that fails partway is aborted rather than closed
+// off, so the client sees it truncated.
+int search_course(sqlite3 *db, char *err_msg, http_request *request,
+                  const char *department, bool buffered) {
+  CourseStream stream = {.request = request, .buffered = buffered};
 
-  char *sql =
-      "SELECT * FROM courses WHERE LOWER(department) LIKE \"csc\" LIMIT 15;";
-  int rc = sqlite3_exec(db, sql, course_from_row, &outgoing, &err_msg);
+  char *sql = sqlite3_mprintf(
+      "SELECT * FROM courses WHERE LOWER(department) = %Q LIMIT 15;",
+      department);
+  int rc = sqlite3_exec(db, sql, course_from_row, &stream, &err_msg);
+  sqlite3_free(sql);
 
   if (rc != SQLITE_OK) {
-    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    // SQLITE_ABORT is course_from_row giving up, on a row it could not
+    // build or a client that went away
+    if (rc != SQLITE_ABORT)
+      fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
     sqlite3_free(err_msg);
-    sqlite3_close(db);
+    free(stream.body);
+    if (!stream.begun)
+      return -1;
+    http_respond_abort(request);
     return 0;
   }
 
-  char *out = json_stringify(outgoing, false);
-  json_free_element(outgoing);
+  if (stream.rows == 0) {
+    // Nothing matched, the array never got opened
+    course_stream_begin(&stream);
+    rc = course_emit(&stream, "[]", 2);
+  } else {
+    rc = course_emit(&stream, "]", 1);
+  }
+  if (!buffered) {
+    http_respond_end(request);
+    return 0;
+  }
+  if (rc != 0) {
+    free(stream.body);
+    return -1;
+  }
 
-  return out;
+  http_response response = {0};
+  http_set_response_status(&response, HTTP_OK);
+  response.content_type = CONTENT_TYPE_TEXT;
+  response.body = stream.body;
+  response.body_len = stream.len;
+  response.free_body = true;
+  // The same searches come in again and again, and are compressed only once
+  response.cache_key = request->request_line->request_uri;
+  http_respond(&response, request);
+  return 0;
 }
 
+// Answers with an empty body
+void respond_status(http_request *request, int status) {
+  http_response response = {0};
+  response.body = "";
+  http_set_response_status(&response, status);
+  response.content_type = CONTENT_TYPE_TEXT;
+  http_respond(&response, request);
+}
+
+void course_search_handle(http_request *request,
+                          const http_route_params *params, void **context) {
+  json_element *parsed = json_parse(request->body);
+  char *str = json_stringify(parsed, false);
+  puts(str);
+  free(str);
+  json_free_element(parsed);
+  if (search_course((sqlite3 *)context[0], (char *)context[1], request,
+                    "csc", false) != 0)
+    respond_status(request, HTTP_NOT_FOUND);
+}
+
+// GET /api/course_search?dept=...: parameters come in the query string, so
+// there is no body to parse and responses can be cached along the way
+void course_query_handle(http_request *request,
+                         const http_route_params *params, void **context) {
+  char department[64];
+  long len = http_query_get(request, "dept", department, sizeof department);
+  if (len == -1) {
+    strcpy(department, "csc");
+  } else if (len < 0 || strlen(department) != (size_t)len) {
+    // Too long for any department, or with a NUL in it
+    respond_status(request, HTTP_BAD_REQUEST);
+    return;
+  }
+  // Matched whole and without case, so % and _ are not wildcards
+  for (char *c = department; *c != '\0'; c++)
+    *c = tolower((unsigned char)*c);
+  if (search_course((sqlite3 *)context[0], (char *)context[1], request,
+                    department, true) != 0)
+    respond_status(request, HTTP_NOT_FOUND);
+}
+
+http_router *router;
+
 void req_handle(http_request *request, void **context) {
+  char *headers = http_headers_to_string(request->headers, false);
   printf("%s %s %s %s\n", http_method_str[request->request_line->method],
-         request->request_line->request_uri,
-         http_headers_to_string(request->headers, false), request->body);
-
-  http_response response = {0};
+         request->request_line->request_uri, headers ? headers : "",
+         request->body);
+  free(headers);
 
-  if (strstr(request->request_line->request_uri, "/api/course_search")) {
-    json_element *parsed = json_parse(request->body);
-    char *str = json_stringify(parsed, false);
-    puts(str);
-    free(str);
-    json_free_element(parsed);
-    response.body = search_course((sqlite3 *)context[0], (char *)context[1]);
+  unsigned allowed;
+  int status = http_router_dispatch(router, request, context, &allowed);
+  if (status == HTTP_METHOD_NOT_ALLOWED) {
+    // Has to say which methods the path does take
+    char allow[128];
+    http_router_format_allow(allowed, allow, sizeof allow);
+    http_response response = {0};
+    response.body = "";
+    http_set_response_status(&response, status);
+    response.content_type = CONTENT_TYPE_TEXT;
+    http_set_response_header(&response, "Allow", allow);
+    http_respond(&response, request);
+    free(response.headers);
+  } else if (status != 0) {
+    respond_status(request, status);
   }
+}
 
-  http_set_response_status(&response, response.body ? HTTP_OK : HTTP_NOT_FOUND);
-  http_set_response_header(&response, "Content-Type", CONTENT_TYPE_TEXT);
+// Gives every server worker its own connection to the catalog
+void **worker_context(int worker, void **shared) {
+  sqlite3 *db;
+  if (sqlite3_open("catalog.db", &db) != SQLITE_OK) {
+    fprintf(stderr, "Worker %d cannot open database %s\n", worker,
+            sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return shared;
+  }
+  void **context = calloc(2, sizeof(void *));
+  if (context == NULL) {
+    sqlite3_close(db);
+    return shared;
+  }
+  context[0] = db;
+  return context;
+}
 
-  http_respond(&response, request);
-  free(response.body);
+// Closes what worker_context opened once the worker is done
+void worker_context_free(int worker, void **context) {
+  sqlite3_close(context[0]);
+  free(context);
 }
 
 int main() {
@@ -96,7 +263,33 @@ int main() {
   json_free_element(test_obj);
   */
 
-  struct http_server server = http_server_init("8080", req_handle, context);
+  router = http_router_create();
+  if (router == NULL ||
+      http_router_add(router, GET, "/api/course_search",
+                      course_query_handle) != 0 ||
+      http_router_add(router, POST, "/api/course_search",
+                      course_search_handle) != 0) {
+    fprintf(stderr, "Cannot set up routes\n");
+    http_router_destroy(router);
+    sqlite3_close(db);
+
+    return 1;
+  }
+
+  http_server_options options;
+  http_server_default_options(&options);
+  options.workers = HTTP_WORKERS_AUTO;
+  options.worker_context = worker_context;
+  options.worker_context_free = worker_context_free;
+  options.handler_threads = 4;
+  // Search results are JSON, which shrinks several times over
+  options.compress_min_size = 1024;
+  // Starting a new build next to a running one takes over its port; the old
+  // one finishes its requests and exits
+  options.handoff_path = "nvrchserver.sock";
+
+  struct http_server server =
+      http_server_init("8080", req_handle, context, &options);
   http_server_listen(server);
 
   /*
@@ -104,6 +297,8 @@ int main() {
   printf("%s", result);
   free(result);
 */
+  // Listening only ends once a new build took over, which is not a failure
+  http_router_destroy(router);
   sqlite3_close(db);
-  return 1;
+  return 0;
 }